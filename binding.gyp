@@ -10,6 +10,13 @@
         'src/compress.cc',
         'src/decompress.cc',
         'src/exports.cc',
+        'src/file.cc',
+        'src/hash.cc',
+        'src/libjpeg.cc',
+        'src/luma.cc',
+        'src/memory.cc',
+        'src/optimize.cc',
+        'src/stream.cc',
       ],
       'include_dirs': [
         '<!(node -e "require(\'nan\')")'
@@ -93,8 +93,19 @@
       ],
       'direct_dependent_settings': {
         'include_dirs': [
+          'include',
           'libjpeg-turbo',
         ],
+        # Anything that affects the jpeglib.h ABI must match the library
+        'defines': [
+          'BITS_IN_JSAMPLE=8',
+          'HAVE_STDDEF_H=1',
+          'HAVE_STDLIB_H=1',
+          'HAVE_UNSIGNED_CHAR=1',
+          'HAVE_UNSIGNED_SHORT=1',
+          'JPEG_LIB_VERSION=62',
+          'MEM_SRCDST_SUPPORTED=1',
+        ],
       },
       'defines': [
         'BUILD="b4922b42e7fee72746caed5a63f67ab9615f9e24"',
@@ -18,3 +18,43 @@ module.exports.decompressSync = function(buffer, optionalOutBuffer, options) {
   out.data = out.data.slice(0, out.size)
   return out
 }
+
+// Convenience wrapper for Buffer slicing.
+module.exports.decompressFileSync = function(path, optionalOutBuffer, options) {
+  var out = binding.decompressFileSync(path, optionalOutBuffer, options)
+  out.data = out.data.slice(0, out.size)
+  return out
+}
+
+// Convenience wrapper for Buffer slicing.
+module.exports.decompressLumaSync = function(buf, optionalOutBuffer, options) {
+  var out = binding.decompressLumaSync(buf, optionalOutBuffer, options)
+  out.data = out.data.slice(0, out.size)
+  return out
+}
+
+// Hashes several images at once. Each image is queued separately, so they
+// are spread over all threads in the pool. A failed image doesn't fail the
+// batch; its slot in the results holds the Error instead.
+module.exports.dctHashBatch = function(images, options, callback) {
+  var results = new Array(images.length)
+  var pending = images.length
+
+  if (typeof options === 'function') {
+    callback = options
+    options = {}
+  }
+
+  if (pending === 0) {
+    return process.nextTick(callback, null, results)
+  }
+
+  images.forEach(function(image, i) {
+    binding.dctHash(image, options, function(err, result) {
+      results[i] = err ? (err instanceof Error ? err : new Error(err)) : result
+      if (--pending === 0) {
+        callback(null, results)
+      }
+    })
+  })
+}
@@ -1,4 +1,7 @@
 #include "exports.h"
+
+#include <stdlib.h>
+
 using namespace Nan;
 using namespace v8;
 using namespace node;
@@ -6,15 +9,12 @@ using namespace node;
 static char errStr[NJT_MSG_LENGTH_MAX] = "No error";
 #define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
 
-void compressBufferFreeCallback(char *data, void *hint) {
-  tjFree((unsigned char*) data);
-}
-
-int compress(unsigned char* srcData, uint32_t format, uint32_t width, uint32_t stride, uint32_t height, uint32_t jpegSubsamp, int quality, unsigned long* jpegSize, unsigned char** dstData, uint32_t dstBufferLength) {
+int compress(unsigned char* srcData, uint32_t format, uint32_t width, uint32_t stride, uint32_t height, uint32_t jpegSubsamp, int quality, bool compact, unsigned long* jpegSize, unsigned char** dstData, uint32_t dstBufferLength) {
   int retval = 0;
   int err;
 
   tjhandle handle = NULL;
+  unsigned char* compactData = NULL;
   int flags = TJFLAG_FASTDCT;
   int bpp = 0;
   uint32_t dstLength = 0;
@@ -73,6 +73,18 @@ int compress(unsigned char* srcData, uint32_t format, uint32_t width, uint32_t s
     _throw(tjGetErrorStr());
   }
 
+  // The output buffer grows by doubling, so it may be up to twice as large
+  // as the image. Shrink it to the exact size so that only the image itself
+  // stays alive while JS holds on to it. tjAlloc() is plain malloc(), so
+  // realloc() can usually do this in place without copying. If it fails,
+  // the larger buffer is still perfectly usable.
+  if (dstBufferLength == 0 && compact) {
+    compactData = (unsigned char*) realloc(*dstData, *jpegSize);
+    if (compactData != NULL) {
+      *dstData = compactData;
+    }
+  }
+
   bailout:
   if (handle != NULL) {
     err = 0;
@@ -82,38 +94,123 @@ int compress(unsigned char* srcData, uint32_t format, uint32_t width, uint32_t s
     if (err != 0 && retval == 0) {
       snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", tjGetErrorStr());
     }
+  }
 
-    if (dstBufferLength > 0 && dstData != NULL) {
-      tjFree(*dstData);
-    }
+  // Only free what we allocated, never the caller's buffer
+  if (retval != 0 && dstBufferLength == 0 && *dstData != NULL) {
+    tjFree(*dstData);
+    *dstData = NULL;
   }
 
   return retval;
 }
 
+class CompressWorker;
+
+// Serializes compress jobs for a single stream. Only one job runs at a time
+// and at most `depth` jobs wait behind it. Newer frames supersede waiting
+// ones, so a slow consumer always gets the latest frame next instead of an
+// ever-growing backlog.
+class CompressQueue : public ObjectWrap {
+  public:
+    static NAN_MODULE_INIT(Init);
+
+    void Push(CompressWorker* worker);
+    void Done(CompressWorker* worker);
+
+  private:
+    explicit CompressQueue(uint32_t depth) :
+      depth(depth),
+      running(NULL),
+      active(false) {
+        this->async = new uv_async_t;
+        uv_async_init(uv_default_loop(), this->async, DeliverCancelled);
+        this->async->data = this;
+        // Only keeps the loop alive while there are cancellations to deliver
+        uv_unref((uv_handle_t*) this->async);
+      }
+
+    ~CompressQueue() {
+      uv_close((uv_handle_t*) this->async, CloseAsync);
+    }
+
+    void Next();
+    void Drop(CompressWorker* worker, const char* reason);
+    void CancelPending(const char* reason);
+
+    static void DeliverCancelled(uv_async_t* handle);
+    static void CloseAsync(uv_handle_t* handle);
+
+    static NAN_METHOD(JsNew);
+    static NAN_METHOD(JsCompress);
+    static NAN_METHOD(JsCancel);
+
+    uint32_t depth;
+    std::deque<CompressWorker*> pending;
+    std::deque<CompressWorker*> cancelled;
+    CompressWorker* running;
+    bool active;
+    uv_async_t* async;
+};
+
 class CompressWorker : public AsyncWorker {
   public:
-    CompressWorker(Callback *callback, unsigned char* srcData, uint32_t format, uint32_t width, uint32_t stride, uint32_t height, uint32_t jpegSubsamp, int quality, Local<Object> &dstObject, unsigned char* dstData, uint32_t dstBufferLength) :
+    CompressWorker(Callback *callback, Local<Object> &srcObject, unsigned char* srcData, const char* path, uint32_t format, uint32_t width, uint32_t stride, uint32_t height, uint32_t jpegSubsamp, int quality, bool compact, Local<Object> &dstObject, unsigned char* dstData, uint32_t dstBufferLength, CompressQueue* queue, uint64_t deadline) :
       AsyncWorker(callback),
       srcData(srcData),
+      path(path != NULL ? path : ""),
       format(format),
       width(width),
       stride(stride),
       height(height),
       jpegSubsamp(jpegSubsamp),
       quality(quality),
+      compact(compact),
       jpegSize(0),
       dstData(dstData),
-      dstBufferLength(dstBufferLength) {
+      dstBufferLength(dstBufferLength),
+      queue(queue),
+      deadline(deadline),
+      cancelReason(NULL) {
+        // Queued frames may wait for a while, keep the source alive
+        if (queue != NULL) {
+          SaveToPersistent("srcObject", srcObject);
+        }
         if (dstBufferLength > 0) {
           SaveToPersistent("dstObject", dstObject);
         }
       }
     ~CompressWorker() {}
 
+    bool Expired() {
+      return this->deadline != 0 && uv_hrtime() > this->deadline;
+    }
+
+    // Drops a frame that never started. The queue calls Cancelled() later
+    // on the main thread, so the callback is still called asynchronously.
+    void Cancel(const char* reason) {
+      this->queue = NULL;
+      this->cancelReason = reason;
+    }
+
+    // Calls back with an error that has `cancelled` set, without ever
+    // taking a thread pool slot
+    void Cancelled() {
+      SetErrorMessage(this->cancelReason);
+      WorkComplete();
+      Destroy();
+    }
+
     void Execute () {
       int err;
 
+      // The frame may have expired while waiting for a free thread
+      if (this->Expired()) {
+        this->cancelReason = "Frame deadline exceeded";
+        SetErrorMessage(this->cancelReason);
+        return;
+      }
+
       err = compress(
           this->srcData,
           this->format,
@@ -122,12 +219,26 @@ class CompressWorker : public AsyncWorker {
           this->height,
           this->jpegSubsamp,
           this->quality,
+          this->compact,
           &this->jpegSize,
           &this->dstData,
           this->dstBufferLength);
 
       if(err != 0) {
         SetErrorMessage(errStr);
+        return;
+      }
+
+      // Write the file on the worker thread so that the encoded image never
+      // enters the JS heap
+      if (!this->path.empty()) {
+        err = njtWriteFile(this->path.c_str(), this->dstData, this->jpegSize, errStr);
+        tjFree(this->dstData);
+        this->dstData = NULL;
+
+        if (err != 0) {
+          SetErrorMessage(errStr);
+        }
       }
     }
 
@@ -135,15 +246,25 @@ class CompressWorker : public AsyncWorker {
       Local<Object> obj = New<Object>();
       Local<Object> dstObject;
 
-      if (this->dstBufferLength > 0) {
-        dstObject = GetFromPersistent("dstObject").As<Object>();
+      // Let the next frame start before we call back
+      if (this->queue != NULL) {
+        this->queue->Done(this);
       }
-      else {
-        dstObject = NewBuffer((char*)this->dstData, this->jpegSize, compressBufferFreeCallback, NULL).ToLocalChecked();
+
+      if (!this->path.empty()) {
+        obj->Set(New("size").ToLocalChecked(), New((uint32_t) this->jpegSize));
       }
+      else {
+        if (this->dstBufferLength > 0) {
+          dstObject = GetFromPersistent("dstObject").As<Object>();
+        }
+        else {
+          dstObject = njtNewBuffer(this->dstData, this->jpegSize);
+        }
 
-      obj->Set(New("data").ToLocalChecked(), dstObject);
-      obj->Set(New("size").ToLocalChecked(), New((uint32_t) this->jpegSize));
+        obj->Set(New("data").ToLocalChecked(), dstObject);
+        obj->Set(New("size").ToLocalChecked(), New((uint32_t) this->jpegSize));
+      }
 
       v8::Local<v8::Value> argv[] = {
         Nan::Null(),
@@ -153,25 +274,147 @@ class CompressWorker : public AsyncWorker {
       callback->Call(2, argv);
     }
 
+    void HandleErrorCallback () {
+      Local<Object> err;
+
+      if (this->queue != NULL) {
+        this->queue->Done(this);
+      }
+
+      err = Nan::Error(ErrorMessage()).As<Object>();
+      if (this->cancelReason != NULL) {
+        err->Set(New("cancelled").ToLocalChecked(), True());
+      }
+
+      Local<Value> argv[] = {
+        err
+      };
+
+      callback->Call(1, argv);
+    }
+
   private:
     unsigned char* srcData;
+    std::string path;
     uint32_t format;
     uint32_t width;
     uint32_t stride;
     uint32_t height;
     uint32_t jpegSubsamp;
     int quality;
+    bool compact;
     unsigned long jpegSize;
     unsigned char* dstData;
     uint32_t dstBufferLength;
+    CompressQueue* queue;
+    uint64_t deadline;
+    const char* cancelReason;
 };
 
-void compressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+NAN_MODULE_INIT(CompressQueue::Init) {
+  Local<FunctionTemplate> tpl = New<FunctionTemplate>(JsNew);
+  tpl->SetClassName(New("CompressQueue").ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+  SetPrototypeMethod(tpl, "compress", JsCompress);
+  SetPrototypeMethod(tpl, "cancel", JsCancel);
+
+  Set(target, New("CompressQueue").ToLocalChecked(), GetFunction(tpl).ToLocalChecked());
+}
+
+void CompressQueue::Push(CompressWorker* worker) {
+  // Frames that haven't started yet are superseded by newer ones
+  while (this->pending.size() >= this->depth) {
+    CompressWorker* dropped = this->pending.front();
+    this->pending.pop_front();
+    this->Drop(dropped, "Frame superseded");
+  }
+
+  this->pending.push_back(worker);
+
+  // Keep ourselves alive while there's work in flight
+  if (!this->active) {
+    this->active = true;
+    Ref();
+  }
+
+  this->Next();
+}
+
+void CompressQueue::Done(CompressWorker* worker) {
+  if (this->running == worker) {
+    this->running = NULL;
+  }
+
+  this->Next();
+}
+
+void CompressQueue::Next() {
+  while (this->running == NULL && !this->pending.empty()) {
+    CompressWorker* worker = this->pending.front();
+    this->pending.pop_front();
+
+    if (worker->Expired()) {
+      this->Drop(worker, "Frame deadline exceeded");
+      continue;
+    }
+
+    this->running = worker;
+    AsyncQueueWorker(worker);
+  }
+
+  if (this->running == NULL && this->pending.empty() && this->cancelled.empty() && this->active) {
+    this->active = false;
+    Unref();
+  }
+}
+
+void CompressQueue::Drop(CompressWorker* worker, const char* reason) {
+  worker->Cancel(reason);
+  this->cancelled.push_back(worker);
+  uv_ref((uv_handle_t*) this->async);
+  uv_async_send(this->async);
+}
+
+void CompressQueue::CancelPending(const char* reason) {
+  while (!this->pending.empty()) {
+    CompressWorker* dropped = this->pending.front();
+    this->pending.pop_front();
+    this->Drop(dropped, reason);
+  }
+
+  this->Next();
+}
+
+void CompressQueue::DeliverCancelled(uv_async_t* handle) {
+  CompressQueue* queue = (CompressQueue*) handle->data;
+  std::deque<CompressWorker*> cancelled;
+
+  // Callbacks may push more frames and cancel others, those are delivered
+  // on the next round
+  cancelled.swap(queue->cancelled);
+  uv_unref((uv_handle_t*) queue->async);
+
+  while (!cancelled.empty()) {
+    CompressWorker* worker = cancelled.front();
+    cancelled.pop_front();
+    worker->Cancelled();
+  }
+
+  queue->Next();
+}
+
+void CompressQueue::CloseAsync(uv_handle_t* handle) {
+  delete (uv_async_t*) handle;
+}
+
+void compressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async, bool toFile, CompressQueue* queue) {
   int retval = 0;
   int cursor = 0;
 
   // Input
   Callback *callback = NULL;
+  std::string path;
   Local<Object> srcObject;
   unsigned char* srcData = NULL;
   Local<Object> dstObject;
@@ -190,6 +433,10 @@ void compressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
   uint32_t stride;
   Local<Value> qualityObject;
   int quality = NJT_DEFAULT_QUALITY;
+  Local<Value> compactObject;
+  bool compact = true;
+  Local<Value> deadlineObject;
+  uint64_t deadline = 0;
 
   // Output
   unsigned long jpegSize = 0;
@@ -204,10 +451,18 @@ void compressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
     }
   }
 
-  if ((async && info.Length() < 3) || (!async && info.Length() < 2)) {
+  if ((async && info.Length() < 3 + toFile) || (!async && info.Length() < 2 + toFile)) {
     _throw("Too few arguments");
   }
 
+  // Output path
+  if (toFile) {
+    if (!info[cursor]->IsString()) {
+      _throw("Invalid path");
+    }
+    path = *Utf8String(info[cursor++]);
+  }
+
   // Input buffer
   srcObject = info[cursor++].As<Object>();
   if (!Buffer::HasInstance(srcObject)) {
@@ -220,7 +475,7 @@ void compressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
 
   // Check if options we just got is actually the destination buffer
   // If it is, pull new object from info and set that as options
-  if (Buffer::HasInstance(options) && info.Length() > cursor) {
+  if (!toFile && Buffer::HasInstance(options) && info.Length() > cursor) {
     dstObject = options;
     options = info[cursor++].As<Object>();
     dstBufferLength = Buffer::Length(dstObject);
@@ -291,9 +546,39 @@ void compressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
     quality = qualityObject->Uint32Value();
   }
 
+  // Whether to copy allocated output into an exactly sized buffer. There's
+  // no point when writing to a file, as the output is freed right away.
+  compactObject = options->Get(New("compact").ToLocalChecked());
+  if (!compactObject->IsUndefined()) {
+    if (!compactObject->IsBoolean()) {
+      _throw("Invalid compact value");
+    }
+    compact = compactObject->BooleanValue();
+  }
+  if (toFile) {
+    compact = false;
+  }
+
+  // Deadline (in milliseconds from now) after which a queued frame is dropped
+  if (queue != NULL) {
+    deadlineObject = options->Get(New("deadline").ToLocalChecked());
+    if (!deadlineObject->IsUndefined()) {
+      if (!deadlineObject->IsUint32()) {
+        _throw("Invalid deadline value");
+      }
+      deadline = uv_hrtime() + (uint64_t) deadlineObject->Uint32Value() * 1000000;
+    }
+  }
+
   // Do either async or sync compress
   if (async) {
-    AsyncQueueWorker(new CompressWorker(callback, srcData, format, width, stride, height, jpegSubsamp, quality, dstObject, dstData, dstBufferLength));
+    CompressWorker* worker = new CompressWorker(callback, srcObject, srcData, toFile ? path.c_str() : NULL, format, width, stride, height, jpegSubsamp, quality, compact, dstObject, dstData, dstBufferLength, queue, deadline);
+    if (queue != NULL) {
+      queue->Push(worker);
+    }
+    else {
+      AsyncQueueWorker(worker);
+    }
     return;
   }
   else {
@@ -305,6 +590,7 @@ void compressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
         height,
         jpegSubsamp,
         quality,
+        compact,
         &jpegSize,
         &dstData,
         dstBufferLength);
@@ -313,9 +599,24 @@ void compressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
       // Compress will set the errStr
       goto bailout;
     }
+
+    if (toFile) {
+      retval = njtWriteFile(path.c_str(), dstData, jpegSize, errStr);
+      tjFree(dstData);
+      if (retval != 0) {
+        goto bailout;
+      }
+    }
+
     Local<Object> obj = New<Object>();
+    if (toFile) {
+      obj->Set(New("size").ToLocalChecked(), New((uint32_t) jpegSize));
+      info.GetReturnValue().Set(obj);
+      return;
+    }
+
     if (dstBufferLength == 0) {
-      dstObject = NewBuffer((char*)dstData, jpegSize, compressBufferFreeCallback, NULL).ToLocalChecked();
+      dstObject = njtNewBuffer(dstData, jpegSize);
     }
 
     obj->Set(New("data").ToLocalChecked(), dstObject);
@@ -341,10 +642,60 @@ void compressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
 }
 
 NAN_METHOD(CompressSync) {
-  compressParse(info, false);
+  compressParse(info, false, false, NULL);
 }
 
 NAN_METHOD(Compress) {
-  compressParse(info, true);
+  compressParse(info, true, false, NULL);
+}
+
+NAN_METHOD(CompressToFileSync) {
+  compressParse(info, false, true, NULL);
+}
+
+NAN_METHOD(CompressToFile) {
+  compressParse(info, true, true, NULL);
+}
+
+NAN_METHOD(CompressQueue::JsNew) {
+  Local<Object> options;
+  Local<Value> depthObject;
+  uint32_t depth = 1;
+
+  if (!info.IsConstructCall()) {
+    return ThrowError(TypeError("Use the new operator to create a CompressQueue"));
+  }
+
+  // Options are optional
+  if (info.Length() > 0 && info[0]->IsObject()) {
+    options = info[0].As<Object>();
+
+    // Number of frames allowed to wait behind the running one
+    depthObject = options->Get(New("depth").ToLocalChecked());
+    if (!depthObject->IsUndefined()) {
+      if (!depthObject->IsUint32() || depthObject->Uint32Value() < 1) {
+        return ThrowError(TypeError("Invalid depth value"));
+      }
+      depth = depthObject->Uint32Value();
+    }
+  }
+
+  CompressQueue* queue = new CompressQueue(depth);
+  queue->Wrap(info.This());
+  info.GetReturnValue().Set(info.This());
+}
+
+NAN_METHOD(CompressQueue::JsCompress) {
+  CompressQueue* queue = ObjectWrap::Unwrap<CompressQueue>(info.Holder());
+  compressParse(info, true, false, queue);
 }
 
+NAN_METHOD(CompressQueue::JsCancel) {
+  CompressQueue* queue = ObjectWrap::Unwrap<CompressQueue>(info.Holder());
+  queue->CancelPending("Frame cancelled");
+}
+
+
+NAN_MODULE_INIT(InitCompressQueue) {
+  CompressQueue::Init(target);
+}
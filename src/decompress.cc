@@ -6,11 +6,12 @@ using namespace node;
 static char errStr[NJT_MSG_LENGTH_MAX] = "No error";
 #define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
 
-int decompress(unsigned char* srcData, uint32_t srcLength, uint32_t format, int* width, int* height, uint32_t* dstLength, unsigned char** dstData, uint32_t dstBufferLength) {
+int decompress(unsigned char* srcData, uint32_t srcLength, uint32_t format, uint32_t maxPixels, uint64_t* reserved, int* width, int* height, uint32_t* dstLength, unsigned char** dstData, uint32_t dstBufferLength) {
   int retval = 0;
   int err;
   tjhandle handle = NULL;
   int bpp;
+  bool memoryHeld = false;
 
   // Figure out bpp from format (needed to calculate output buffer size)
   switch (format) {
@@ -46,7 +47,10 @@ int decompress(unsigned char* srcData, uint32_t srcLength, uint32_t format, int*
     _throw(tjGetErrorStr());
   }
 
-  *dstLength = *width * *height * bpp;
+  if (njtOutputLength(*width, *height, bpp, maxPixels, dstLength, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
 
   if (dstBufferLength > 0) {
     if (dstBufferLength < *dstLength) {
@@ -54,7 +58,17 @@ int decompress(unsigned char* srcData, uint32_t srcLength, uint32_t format, int*
     }
   }
   else {
-    *dstData = (unsigned char*)malloc(*dstLength);
+    // Returns 1 when an async job has to wait for memory
+    retval = njtReserveMemory(*dstLength, reserved, errStr);
+    if (retval != 0) {
+      goto bailout;
+    }
+    memoryHeld = true;
+
+    *dstData = tjAlloc(*dstLength);
+    if (*dstData == NULL) {
+      _throw("Out of memory");
+    }
   }
 
   err = tjDecompress2(handle, srcData, srcLength, *dstData, *width, 0, *height, format, TJFLAG_FASTDCT);
@@ -75,21 +89,36 @@ int decompress(unsigned char* srcData, uint32_t srcLength, uint32_t format, int*
     }
   }
 
+  // On success the reservation is released once the buffer is handed to JS
+  if (retval != 0 && memoryHeld) {
+    tjFree(*dstData);
+    *dstData = NULL;
+    njtReleaseMemory(*dstLength);
+  }
+
   return retval;
 }
 
-class DecompressWorker : public AsyncWorker {
+class DecompressWorker : public NJTBudgetWorker {
   public:
-    DecompressWorker(Callback *callback, unsigned char* srcData, uint32_t srcLength, uint32_t format, Local<Object> &dstObject, unsigned char* dstData, uint32_t dstBufferLength) :
-      AsyncWorker(callback),
+    DecompressWorker(Callback *callback, Local<Object> &srcObject, unsigned char* srcData, uint32_t srcLength, const char* path, bool useMmap, uint32_t format, uint32_t maxPixels, Local<Object> &dstObject, unsigned char* dstData, uint32_t dstBufferLength) :
+      NJTBudgetWorker(callback),
       srcData(srcData),
       srcLength(srcLength),
+      path(path != NULL ? path : ""),
+      useMmap(useMmap),
       format(format),
+      maxPixels(maxPixels),
       dstData(dstData),
       dstBufferLength(dstBufferLength),
       width(0),
       height(0),
       dstLength(0) {
+        // The worker may be parked for a while when the memory budget is
+        // full, keep the source alive
+        if (path == NULL) {
+          SaveToPersistent("srcObject", srcObject);
+        }
         if (dstBufferLength > 0) {
           SaveToPersistent("dstObject", dstObject);
         }
@@ -99,18 +128,40 @@ class DecompressWorker : public AsyncWorker {
 
     void Execute () {
       int err;
+      NJTFile file;
+
+      // Read the file on the worker thread so that it never enters the JS heap
+      if (!this->path.empty()) {
+        err = njtReadFile(this->path.c_str(), this->useMmap, &file, errStr);
+        if (err != 0) {
+          SetErrorMessage(errStr);
+          return;
+        }
+        this->srcData = file.data;
+        this->srcLength = file.length;
+      }
 
       err = decompress(
           this->srcData,
           this->srcLength,
           this->format,
+          this->maxPixels,
+          &this->reserved,
           &this->width,
           &this->height,
           &this->dstLength,
           &this->dstData,
           this->dstBufferLength);
 
-      if(err != 0) {
+      if (!this->path.empty()) {
+        njtReleaseFile(&file);
+        this->srcData = NULL;
+      }
+
+      if (err == 1) {
+        this->deferred = this->dstLength;
+      }
+      else if(err != 0) {
         SetErrorMessage(errStr);
       }
     }
@@ -123,7 +174,8 @@ class DecompressWorker : public AsyncWorker {
         dstObject = GetFromPersistent("dstObject").As<Object>();
       }
       else {
-        dstObject = NewBuffer((char*)this->dstData, this->dstLength).ToLocalChecked();
+        dstObject = njtNewBuffer(this->dstData, this->dstLength);
+        njtReleaseMemory(this->dstLength);
       }
 
       obj->Set(New("data").ToLocalChecked(), dstObject);
@@ -143,7 +195,10 @@ class DecompressWorker : public AsyncWorker {
   private:
     unsigned char* srcData;
     uint32_t srcLength;
+    std::string path;
+    bool useMmap;
     uint32_t format;
+    uint32_t maxPixels;
 
     unsigned char* dstData;
     uint32_t dstBufferLength;
@@ -152,7 +207,7 @@ class DecompressWorker : public AsyncWorker {
     uint32_t dstLength;
 };
 
-void decompressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+void decompressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async, bool fromFile) {
   int retval = 0;
   int cursor = 0;
 
@@ -161,9 +216,15 @@ void decompressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
   Local<Object> srcObject;
   unsigned char* srcData = NULL;
   uint32_t srcLength = 0;
+  std::string path;
+  NJTFile file;
   Local<Object> options;
   Local<Value> formatObject;
   uint32_t format = NJT_DEFAULT_FORMAT;
+  Local<Value> mmapObject;
+  bool useMmap = false;
+  Local<Value> maxPixelsObject;
+  uint32_t maxPixels = 0;
 
   // Output
   Local<Object> dstObject;
@@ -187,14 +248,22 @@ void decompressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
     _throw("Too few arguments");
   }
 
-  // Input buffer
-  srcObject = info[cursor++].As<Object>();
-  if (!Buffer::HasInstance(srcObject)) {
-    _throw("Invalid source buffer");
+  // Input buffer or path
+  if (fromFile) {
+    if (!info[cursor]->IsString()) {
+      _throw("Invalid path");
+    }
+    path = *Utf8String(info[cursor++]);
   }
+  else {
+    srcObject = info[cursor++].As<Object>();
+    if (!Buffer::HasInstance(srcObject)) {
+      _throw("Invalid source buffer");
+    }
 
-  srcData = (unsigned char*) Buffer::Data(srcObject);
-  srcLength = Buffer::Length(srcObject);
+    srcData = (unsigned char*) Buffer::Data(srcObject);
+    srcLength = Buffer::Length(srcObject);
+  }
 
   // Options
   options = info[cursor++].As<Object>();
@@ -218,24 +287,58 @@ void decompressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
       }
       format = formatObject->Uint32Value();
     }
+
+    // Refuse to decode images with more pixels than this
+    maxPixelsObject = options->Get(New("maxPixels").ToLocalChecked());
+    if (!maxPixelsObject->IsUndefined()) {
+      if (!maxPixelsObject->IsUint32()) {
+        _throw("Invalid maxPixels value");
+      }
+      maxPixels = maxPixelsObject->Uint32Value();
+    }
+
+    // Whether to map the input file instead of reading it
+    if (fromFile) {
+      mmapObject = options->Get(New("mmap").ToLocalChecked());
+      if (!mmapObject->IsUndefined()) {
+        if (!mmapObject->IsBoolean()) {
+          _throw("Invalid mmap value");
+        }
+        useMmap = mmapObject->BooleanValue();
+      }
+    }
   }
 
   // Do either async or sync decompress
   if (async) {
-    AsyncQueueWorker(new DecompressWorker(callback, srcData, srcLength, format, dstObject, dstData, dstBufferLength));
+    AsyncQueueWorker(new DecompressWorker(callback, srcObject, srcData, srcLength, fromFile ? path.c_str() : NULL, useMmap, format, maxPixels, dstObject, dstData, dstBufferLength));
     return;
   }
   else {
+    if (fromFile) {
+      retval = njtReadFile(path.c_str(), useMmap, &file, errStr);
+      if (retval != 0) {
+        goto bailout;
+      }
+      srcData = file.data;
+      srcLength = file.length;
+    }
+
     retval = decompress(
         srcData,
         srcLength,
         format,
+        maxPixels,
+        NULL,
         &width,
         &height,
         &dstLength,
         &dstData,
         dstBufferLength);
 
+    if (fromFile) {
+      njtReleaseFile(&file);
+    }
 
     if(retval != 0) {
       // decompress will set the errStr
@@ -244,7 +347,8 @@ void decompressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
     Local<Object> obj = New<Object>();
 
     if (dstBufferLength == 0) {
-      dstObject = NewBuffer((char*)dstData, dstLength).ToLocalChecked();
+      dstObject = njtNewBuffer(dstData, dstLength);
+      njtReleaseMemory(dstLength);
     }
 
     obj->Set(New("data").ToLocalChecked(), dstObject);
@@ -275,9 +379,17 @@ void decompressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
 }
 
 NAN_METHOD(DecompressSync) {
-  decompressParse(info, false);
+  decompressParse(info, false, false);
 }
 
 NAN_METHOD(Decompress) {
-  decompressParse(info, true);
+  decompressParse(info, true, false);
+}
+
+NAN_METHOD(DecompressFileSync) {
+  decompressParse(info, false, true);
+}
+
+NAN_METHOD(DecompressFile) {
+  decompressParse(info, true, true);
 }
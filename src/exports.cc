@@ -1,6 +1,8 @@
 #include "exports.h"
 
 NAN_MODULE_INIT(InitAll) {
+  njtInitMemory();
+
   Nan::Set(target, Nan::New("bufferSize").ToLocalChecked(),
     Nan::GetFunction(Nan::New<v8::FunctionTemplate>(BufferSize)).ToLocalChecked());
   Nan::Set(target, Nan::New("compressSync").ToLocalChecked(),
@@ -11,6 +13,33 @@ NAN_MODULE_INIT(InitAll) {
     Nan::GetFunction(Nan::New<v8::FunctionTemplate>(DecompressSync)).ToLocalChecked());
   Nan::Set(target, Nan::New("decompress").ToLocalChecked(),
     Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Decompress)).ToLocalChecked());
+  Nan::Set(target, Nan::New("compressToFileSync").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(CompressToFileSync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("compressToFile").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(CompressToFile)).ToLocalChecked());
+  Nan::Set(target, Nan::New("decompressFileSync").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(DecompressFileSync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("decompressFile").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(DecompressFile)).ToLocalChecked());
+  Nan::Set(target, Nan::New("decompressLumaSync").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(DecompressLumaSync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("decompressLuma").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(DecompressLuma)).ToLocalChecked());
+  Nan::Set(target, Nan::New("dctHashSync").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(DctHashSync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("dctHash").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(DctHash)).ToLocalChecked());
+  Nan::Set(target, Nan::New("optimizeSync").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(OptimizeSync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("optimize").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Optimize)).ToLocalChecked());
+  Nan::Set(target, Nan::New("setMemoryBudget").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(SetMemoryBudget)).ToLocalChecked());
+  Nan::Set(target, Nan::New("memoryUsage").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(MemoryUsage)).ToLocalChecked());
+  InitCompressQueue(target);
+  InitStreamCompressor(target);
+  InitStreamDecompressor(target);
   Nan::Set(target, Nan::New("FORMAT_RGB").ToLocalChecked(), Nan::New(FORMAT_RGB));
   Nan::Set(target, Nan::New("FORMAT_BGR").ToLocalChecked(), Nan::New(FORMAT_BGR));
   Nan::Set(target, Nan::New("FORMAT_RGBX").ToLocalChecked(), Nan::New(FORMAT_RGBX));
@@ -1,9 +1,19 @@
 #ifndef _NODE_JPEG_TURBO_EXPORTS
 #define _NODE_JPEG_TURBO_EXPORTS
 
+#include <deque>
+#include <string>
+
 #include <nan.h>
 #include <turbojpeg.h>
 
+#include <stdio.h>
+#include <setjmp.h>
+
+extern "C" {
+#include <jpeglib.h>
+}
+
 // Unfortunately Travis still uses Ubuntu 12.04, and their libjpeg-turbo is
 // super old (1.2.0). We still want to build there, but opt in to the new
 // flag when possible.
@@ -12,6 +22,7 @@
 #endif
 
 #define NJT_MSG_LENGTH_MAX 200
+#define NJT_DESTINATION_SIZE 65536
 
 static int NJT_DEFAULT_QUALITY = 80;
 static int NJT_DEFAULT_SUBSAMPLING = TJSAMP_420;
@@ -39,10 +50,83 @@ enum {
   SAMP_440  = TJSAMP_440,
 };
 
+typedef struct {
+  unsigned char* data;
+  uint32_t length;
+  bool mapped;
+} NJTFile;
+
+int njtReadFile(const char* path, bool useMmap, NJTFile* file, char* errStr);
+void njtReleaseFile(NJTFile* file);
+int njtWriteFile(const char* path, unsigned char* data, unsigned long length, char* errStr);
+
+void njtInitMemory();
+int njtReserveMemory(uint64_t bytes, uint64_t* reserved, char* errStr);
+void njtReleaseMemory(uint64_t bytes);
+int njtOutputLength(uint32_t width, uint32_t height, int bpp, uint32_t maxPixels, uint32_t* length, char* errStr);
+v8::Local<v8::Object> njtNewBuffer(unsigned char* data, uint32_t length);
+
+// An AsyncWorker whose output counts against the memory budget. When there's
+// no room, Execute() sets deferred to the number of bytes it needs instead of
+// blocking a thread pool thread. The worker is then parked on the main thread
+// and queued again once the memory has been reserved for it.
+class NJTBudgetWorker : public Nan::AsyncWorker {
+  public:
+    explicit NJTBudgetWorker(Nan::Callback *callback) :
+      AsyncWorker(callback),
+      reserved(0),
+      deferred(0) {}
+
+    void WorkComplete();
+    void Destroy();
+    void Resume(uint64_t bytes);
+    void Reject(const char* message);
+
+    // Memory reserved for the next Execute(), to pass to njtReserveMemory()
+    uint64_t reserved;
+    // Memory the worker is waiting for while parked
+    uint64_t deferred;
+};
+
+struct njt_error_mgr {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+};
+
+struct njt_destination_mgr {
+  struct jpeg_destination_mgr pub;
+  unsigned char* buffer;
+  size_t size;
+};
+
+struct jpeg_error_mgr* njtErrorMgr(struct njt_error_mgr* err);
+void njtDestination(j_compress_ptr cinfo, struct njt_destination_mgr* dest);
+int njtDestinationCopy(struct njt_destination_mgr* dest, unsigned char** dstData, unsigned long* dstLength);
+void njtReleaseDestination(struct njt_destination_mgr* dest);
+int njtBytesPerPixel(uint32_t format);
+J_COLOR_SPACE njtColorSpace(uint32_t format);
+void njtSetSubsampling(j_compress_ptr cinfo, uint32_t jpegSubsamp);
+
 NAN_METHOD(BufferSize);
 NAN_METHOD(CompressSync);
 NAN_METHOD(Compress);
 NAN_METHOD(DecompressSync);
 NAN_METHOD(Decompress);
+NAN_METHOD(CompressToFileSync);
+NAN_METHOD(CompressToFile);
+NAN_METHOD(DecompressFileSync);
+NAN_METHOD(DecompressFile);
+NAN_METHOD(DecompressLumaSync);
+NAN_METHOD(DecompressLuma);
+NAN_METHOD(DctHashSync);
+NAN_METHOD(DctHash);
+NAN_METHOD(OptimizeSync);
+NAN_METHOD(Optimize);
+NAN_METHOD(SetMemoryBudget);
+NAN_METHOD(MemoryUsage);
+
+NAN_MODULE_INIT(InitCompressQueue);
+NAN_MODULE_INIT(InitStreamCompressor);
+NAN_MODULE_INIT(InitStreamDecompressor);
 
 #endif
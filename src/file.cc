@@ -0,0 +1,193 @@
+#include "exports.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <atomic>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s: %s", m, path); retval=-1; goto bailout;}
+
+// Reads the whole file into memory. Meant to be called from a worker
+// thread so that compressed data never has to pass through the JS heap.
+// If useMmap is set (and supported), the file is mapped instead of read.
+int njtReadFile(const char* path, bool useMmap, NJTFile* file, char* errStr) {
+  int retval = 0;
+  FILE* fp = NULL;
+  long length;
+
+  file->data = NULL;
+  file->length = 0;
+  file->mapped = false;
+
+#ifndef _WIN32
+  if (useMmap) {
+    int fd;
+    struct stat st;
+    void* map;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      _throw(strerror(errno));
+    }
+
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      _throw(strerror(errno));
+    }
+
+    if (st.st_size <= 0 || st.st_size > UINT32_MAX) {
+      close(fd);
+      _throw("Invalid file size");
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+      _throw(strerror(errno));
+    }
+
+    file->data = (unsigned char*) map;
+    file->length = (uint32_t) st.st_size;
+    file->mapped = true;
+
+    return 0;
+  }
+#endif
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    _throw(strerror(errno));
+  }
+
+  if (fseek(fp, 0, SEEK_END) != 0 || (length = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+    _throw(strerror(errno));
+  }
+
+  if (length == 0 || (unsigned long) length > UINT32_MAX) {
+    _throw("Invalid file size");
+  }
+
+  file->data = (unsigned char*) malloc(length);
+  if (file->data == NULL) {
+    _throw("Out of memory");
+  }
+
+  if (fread(file->data, 1, length, fp) != (size_t) length) {
+    _throw("Unable to read file");
+  }
+
+  file->length = (uint32_t) length;
+
+  bailout:
+  if (fp != NULL) {
+    fclose(fp);
+  }
+
+  if (retval != 0) {
+    njtReleaseFile(file);
+  }
+
+  return retval;
+}
+
+void njtReleaseFile(NJTFile* file) {
+  if (file->data != NULL) {
+#ifndef _WIN32
+    if (file->mapped) {
+      munmap(file->data, file->length);
+    }
+    else
+#endif
+    {
+      free(file->data);
+    }
+  }
+
+  file->data = NULL;
+  file->length = 0;
+  file->mapped = false;
+}
+
+// Writes the image under a temporary name in the same directory and renames
+// it into place once it's complete, so that a failed write (running out of
+// disk space, for example) never leaves a truncated image behind. Windows
+// can't rename over an existing file, so there the file is written in place
+// and removed on failure instead.
+int njtWriteFile(const char* path, unsigned char* data, unsigned long length, char* errStr) {
+  int retval = 0;
+  FILE* fp = NULL;
+  std::string tmpPath;
+
+#ifndef _WIN32
+  static std::atomic<uint32_t> counter(0);
+  char suffix[64];
+  int fd = -1;
+  int attempt;
+
+  // O_EXCL makes sure that concurrent writes never share a temporary file,
+  // and unlike mkstemp() the mode respects the umask
+  for (attempt = 0; attempt < 100 && fd < 0; attempt++) {
+    snprintf(suffix, sizeof(suffix), ".%ld.%u.tmp", (long) getpid(), (unsigned) counter++);
+    fd = open((std::string(path) + suffix).c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0 && errno != EEXIST) {
+      break;
+    }
+  }
+
+  if (fd < 0) {
+    _throw(strerror(errno));
+  }
+  tmpPath = std::string(path) + suffix;
+
+  fp = fdopen(fd, "wb");
+  if (fp == NULL) {
+    close(fd);
+    _throw(strerror(errno));
+  }
+#else
+  fp = fopen(path, "wb");
+  if (fp == NULL) {
+    _throw(strerror(errno));
+  }
+  tmpPath = path;
+#endif
+
+  if (fwrite(data, 1, length, fp) != length) {
+    _throw("Unable to write file");
+  }
+
+  if (fclose(fp) != 0) {
+    fp = NULL;
+    _throw(strerror(errno));
+  }
+  fp = NULL;
+
+#ifndef _WIN32
+  if (rename(tmpPath.c_str(), path) != 0) {
+    _throw(strerror(errno));
+  }
+#endif
+
+  // Nothing left to clean up
+  tmpPath.clear();
+
+  bailout:
+  if (fp != NULL) {
+    fclose(fp);
+  }
+
+  if (!tmpPath.empty()) {
+    remove(tmpPath.c_str());
+  }
+
+  return retval;
+}
@@ -0,0 +1,385 @@
+#include "exports.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+static char errStr[NJT_MSG_LENGTH_MAX] = "No error";
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+#define NJT_HASH_SIZE 8
+#define NJT_PHASH_SIZE 32
+#define NJT_PI 3.14159265358979323846
+
+// Box filters the w x h source into a size x size destination. Sources
+// smaller than the destination are upscaled with nearest neighbor.
+static void resample(unsigned char* src, uint32_t w, uint32_t h, double* dst, uint32_t size) {
+  uint32_t x, y, sx, sy, x0, x1, y0, y1;
+  double sum;
+
+  for (y = 0; y < size; y++) {
+    y0 = (uint64_t) y * h / size;
+    y1 = std::max(y0 + 1, (uint32_t) ((uint64_t) (y + 1) * h / size));
+
+    for (x = 0; x < size; x++) {
+      x0 = (uint64_t) x * w / size;
+      x1 = std::max(x0 + 1, (uint32_t) ((uint64_t) (x + 1) * w / size));
+
+      sum = 0;
+      for (sy = y0; sy < y1; sy++) {
+        for (sx = x0; sx < x1; sx++) {
+          sum += src[(size_t) sy * w + sx];
+        }
+      }
+
+      dst[y * size + x] = sum / ((y1 - y0) * (x1 - x0));
+    }
+  }
+}
+
+// Average hash: each bit tells whether the corresponding cell of an 8x8
+// thumbnail is brighter than the mean.
+static uint64_t averageHash(unsigned char* thumb, uint32_t w, uint32_t h) {
+  double cells[NJT_HASH_SIZE * NJT_HASH_SIZE];
+  double mean = 0;
+  uint64_t hash = 0;
+  int i;
+
+  resample(thumb, w, h, cells, NJT_HASH_SIZE);
+
+  for (i = 0; i < NJT_HASH_SIZE * NJT_HASH_SIZE; i++) {
+    mean += cells[i];
+  }
+  mean /= NJT_HASH_SIZE * NJT_HASH_SIZE;
+
+  for (i = 0; i < NJT_HASH_SIZE * NJT_HASH_SIZE; i++) {
+    hash = (hash << 1) | (cells[i] > mean ? 1 : 0);
+  }
+
+  return hash;
+}
+
+// Perceptual hash: each bit tells whether the corresponding low frequency
+// coefficient of the DCT of a 32x32 thumbnail is above the median. This is
+// the same algorithm as the imagehash Python module uses, but on a different
+// input, so the values don't match.
+static uint64_t perceptualHash(unsigned char* thumb, uint32_t w, uint32_t h) {
+  double cosines[NJT_HASH_SIZE][NJT_PHASH_SIZE];
+  double pixels[NJT_PHASH_SIZE * NJT_PHASH_SIZE];
+  double rows[NJT_HASH_SIZE * NJT_PHASH_SIZE];
+  double coefs[NJT_HASH_SIZE * NJT_HASH_SIZE];
+  double sorted[NJT_HASH_SIZE * NJT_HASH_SIZE];
+  double median;
+  uint64_t hash = 0;
+  int u, v, x, y, i;
+
+  // Only the lowest 8 frequencies are needed
+  for (u = 0; u < NJT_HASH_SIZE; u++) {
+    for (x = 0; x < NJT_PHASH_SIZE; x++) {
+      cosines[u][x] = cos(NJT_PI * u * (2 * x + 1) / (2 * NJT_PHASH_SIZE));
+    }
+  }
+
+  resample(thumb, w, h, pixels, NJT_PHASH_SIZE);
+
+  // Separable DCT-II, first along the rows and then along the columns
+  for (y = 0; y < NJT_PHASH_SIZE; y++) {
+    for (u = 0; u < NJT_HASH_SIZE; u++) {
+      rows[u * NJT_PHASH_SIZE + y] = 0;
+      for (x = 0; x < NJT_PHASH_SIZE; x++) {
+        rows[u * NJT_PHASH_SIZE + y] += pixels[y * NJT_PHASH_SIZE + x] * cosines[u][x];
+      }
+    }
+  }
+
+  for (v = 0; v < NJT_HASH_SIZE; v++) {
+    for (u = 0; u < NJT_HASH_SIZE; u++) {
+      coefs[v * NJT_HASH_SIZE + u] = 0;
+      for (y = 0; y < NJT_PHASH_SIZE; y++) {
+        coefs[v * NJT_HASH_SIZE + u] += rows[u * NJT_PHASH_SIZE + y] * cosines[v][y];
+      }
+    }
+  }
+
+  memcpy(sorted, coefs, sizeof(coefs));
+  std::sort(sorted, sorted + NJT_HASH_SIZE * NJT_HASH_SIZE);
+  i = NJT_HASH_SIZE * NJT_HASH_SIZE / 2;
+  median = (sorted[i - 1] + sorted[i]) / 2;
+
+  for (i = 0; i < NJT_HASH_SIZE * NJT_HASH_SIZE; i++) {
+    hash = (hash << 1) | (coefs[i] > median ? 1 : 0);
+  }
+
+  return hash;
+}
+
+// Builds a 1/8 scale luma thumbnail from the DC coefficients and hashes it.
+// Only entropy decoding is required; there's no IDCT, upsampling or color
+// conversion at all.
+int dctHash(unsigned char* srcData, uint32_t srcLength, uint32_t maxPixels, uint32_t* width, uint32_t* height, unsigned char** dstData, uint64_t* ahash, uint64_t* phash) {
+  int retval = 0;
+
+  struct jpeg_decompress_struct dinfo;
+  struct njt_error_mgr jerr;
+  jvirt_barray_ptr* coefArrays;
+  jpeg_component_info* compptr;
+  JBLOCKARRAY blocks;
+  JDIMENSION row, col;
+  int dc;
+  int quant;
+  bool inverted;
+
+  memset(&dinfo, 0, sizeof(dinfo));
+  *dstData = NULL;
+
+  dinfo.err = njtErrorMgr(&jerr);
+
+  if (setjmp(jerr.setjmp_buffer)) {
+    (*jerr.pub.format_message)((j_common_ptr) &dinfo, errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  jpeg_create_decompress(&dinfo);
+  jpeg_mem_src(&dinfo, srcData, srcLength);
+  jpeg_read_header(&dinfo, TRUE);
+
+  // The first component is only luma in these color spaces
+  switch (dinfo.jpeg_color_space) {
+    case JCS_GRAYSCALE:
+    case JCS_YCbCr:
+    case JCS_YCCK:
+      break;
+    default:
+      _throw("Unsupported color space");
+  }
+
+  // The coefficients of the whole image are kept in memory
+  if (maxPixels > 0 && (uint64_t) dinfo.image_width * dinfo.image_height > maxPixels) {
+    _throw("Image exceeds pixel limit");
+  }
+
+  // YCCK is YCbCr of the inverted CMY channels, so its luma is inverted too
+  inverted = dinfo.jpeg_color_space == JCS_YCCK;
+
+  coefArrays = jpeg_read_coefficients(&dinfo);
+
+  compptr = &dinfo.comp_info[0];
+  *width = compptr->width_in_blocks;
+  *height = compptr->height_in_blocks;
+  quant = compptr->quant_table->quantval[0];
+
+  *dstData = tjAlloc(*width * *height);
+  if (*dstData == NULL) {
+    _throw("Out of memory");
+  }
+
+  // The DC coefficient is 8 times the mean of the block, level shifted
+  for (row = 0; row < *height; row++) {
+    blocks = (*dinfo.mem->access_virt_barray)((j_common_ptr) &dinfo, coefArrays[0], row, 1, FALSE);
+    for (col = 0; col < *width; col++) {
+      dc = (blocks[0][col][0] * quant + 4) / 8 + 128;
+      if (inverted) {
+        dc = 255 - dc;
+      }
+      (*dstData)[(size_t) row * *width + col] = (unsigned char) std::min(255, std::max(0, dc));
+    }
+  }
+
+  *ahash = averageHash(*dstData, *width, *height);
+  *phash = perceptualHash(*dstData, *width, *height);
+
+  bailout:
+  jpeg_destroy_decompress(&dinfo);
+
+  if (retval != 0 && *dstData != NULL) {
+    tjFree(*dstData);
+    *dstData = NULL;
+  }
+
+  return retval;
+}
+
+// 64-bit hashes don't fit in a JS Number, so they're returned as hex strings
+static Local<Value> hashString(uint64_t hash) {
+  char str[17];
+  snprintf(str, sizeof(str), "%016llx", (unsigned long long) hash);
+  return New(str).ToLocalChecked();
+}
+
+static Local<Object> dctHashResult(unsigned char* dstData, uint32_t width, uint32_t height, uint64_t ahash, uint64_t phash) {
+  Local<Object> obj = New<Object>();
+
+  obj->Set(New("data").ToLocalChecked(), njtNewBuffer(dstData, width * height));
+  obj->Set(New("width").ToLocalChecked(), New(width));
+  obj->Set(New("height").ToLocalChecked(), New(height));
+  obj->Set(New("format").ToLocalChecked(), New(FORMAT_GRAY));
+  obj->Set(New("ahash").ToLocalChecked(), hashString(ahash));
+  obj->Set(New("phash").ToLocalChecked(), hashString(phash));
+
+  return obj;
+}
+
+class DctHashWorker : public AsyncWorker {
+  public:
+    DctHashWorker(Callback *callback, Local<Object> &srcObject, unsigned char* srcData, uint32_t srcLength, uint32_t maxPixels) :
+      AsyncWorker(callback),
+      srcData(srcData),
+      srcLength(srcLength),
+      maxPixels(maxPixels),
+      width(0),
+      height(0),
+      dstData(NULL),
+      ahash(0),
+      phash(0) {
+        SaveToPersistent("srcObject", srcObject);
+      }
+    ~DctHashWorker() {}
+
+    void Execute () {
+      int err;
+
+      err = dctHash(
+          this->srcData,
+          this->srcLength,
+          this->maxPixels,
+          &this->width,
+          &this->height,
+          &this->dstData,
+          &this->ahash,
+          &this->phash);
+
+      if(err != 0) {
+        SetErrorMessage(errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      Local<Value> argv[] = {
+        Null(),
+        dctHashResult(this->dstData, this->width, this->height, this->ahash, this->phash)
+      };
+
+      callback->Call(2, argv);
+    }
+
+  private:
+    unsigned char* srcData;
+    uint32_t srcLength;
+    uint32_t maxPixels;
+
+    uint32_t width;
+    uint32_t height;
+    unsigned char* dstData;
+    uint64_t ahash;
+    uint64_t phash;
+};
+
+void dctHashParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+  int retval = 0;
+  int cursor = 0;
+
+  // Input
+  Callback *callback = NULL;
+  Local<Object> srcObject;
+  unsigned char* srcData = NULL;
+  uint32_t srcLength = 0;
+  Local<Object> options;
+  Local<Value> maxPixelsObject;
+  uint32_t maxPixels = 0;
+
+  // Output
+  uint32_t width;
+  uint32_t height;
+  unsigned char* dstData = NULL;
+  uint64_t ahash;
+  uint64_t phash;
+
+  // Try to find callback here, so if we want to throw something we can use callback's err
+  if (async) {
+    if (info[info.Length() - 1]->IsFunction()) {
+      callback = new Callback(info[info.Length() - 1].As<Function>());
+    }
+    else {
+      _throw("Missing callback");
+    }
+  }
+
+  if ((async && info.Length() < 2) || (!async && info.Length() < 1)) {
+    _throw("Too few arguments");
+  }
+
+  // Input buffer
+  srcObject = info[cursor++].As<Object>();
+  if (!Buffer::HasInstance(srcObject)) {
+    _throw("Invalid source buffer");
+  }
+
+  srcData = (unsigned char*) Buffer::Data(srcObject);
+  srcLength = Buffer::Length(srcObject);
+
+  // Options are optional
+  options = info[cursor++].As<Object>();
+  if (options->IsObject() && !options->IsFunction()) {
+    // Refuse to process images with more pixels than this
+    maxPixelsObject = options->Get(New("maxPixels").ToLocalChecked());
+    if (!maxPixelsObject->IsUndefined()) {
+      if (!maxPixelsObject->IsUint32()) {
+        _throw("Invalid maxPixels value");
+      }
+      maxPixels = maxPixelsObject->Uint32Value();
+    }
+  }
+
+  // Do either async or sync hashing
+  if (async) {
+    AsyncQueueWorker(new DctHashWorker(callback, srcObject, srcData, srcLength, maxPixels));
+    return;
+  }
+  else {
+    retval = dctHash(
+        srcData,
+        srcLength,
+        maxPixels,
+        &width,
+        &height,
+        &dstData,
+        &ahash,
+        &phash);
+
+    if(retval != 0) {
+      // dctHash will set the errStr
+      goto bailout;
+    }
+
+    info.GetReturnValue().Set(dctHashResult(dstData, width, height, ahash, phash));
+    return;
+  }
+
+  // If we have error throw error or call callback with error
+  bailout:
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+NAN_METHOD(DctHashSync) {
+  dctHashParse(info, false);
+}
+
+NAN_METHOD(DctHash) {
+  dctHashParse(info, true);
+}
@@ -0,0 +1,160 @@
+#include "exports.h"
+
+#include <string.h>
+
+extern "C" {
+#include <jerror.h>
+}
+
+// Helpers for the few places where TurboJPEG isn't enough and we have to
+// use the libjpeg API directly.
+
+static void njtErrorExit(j_common_ptr cinfo) {
+  struct njt_error_mgr* err = (struct njt_error_mgr*) cinfo->err;
+  longjmp(err->setjmp_buffer, 1);
+}
+
+static void njtOutputMessage(j_common_ptr cinfo) {
+  // Swallow warnings instead of printing them to stderr
+}
+
+struct jpeg_error_mgr* njtErrorMgr(struct njt_error_mgr* err) {
+  jpeg_std_error(&err->pub);
+  err->pub.error_exit = njtErrorExit;
+  err->pub.output_message = njtOutputMessage;
+  return &err->pub;
+}
+
+// A destination manager that writes into a growable buffer. Unlike
+// jpeg_mem_dest(), the buffer survives between images, so a stream only
+// needs to grow it a few times in its lifetime.
+static void njtInitDestination(j_compress_ptr cinfo) {
+  struct njt_destination_mgr* dest = (struct njt_destination_mgr*) cinfo->dest;
+
+  if (dest->buffer == NULL) {
+    dest->size = NJT_DESTINATION_SIZE;
+    dest->buffer = (unsigned char*) malloc(dest->size);
+    if (dest->buffer == NULL) {
+      dest->size = 0;
+      ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+    }
+  }
+
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = dest->size;
+}
+
+static boolean njtEmptyOutputBuffer(j_compress_ptr cinfo) {
+  struct njt_destination_mgr* dest = (struct njt_destination_mgr*) cinfo->dest;
+  size_t size = dest->size * 2;
+  unsigned char* buffer = (unsigned char*) realloc(dest->buffer, size);
+
+  if (buffer == NULL) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  }
+
+  dest->pub.next_output_byte = buffer + dest->size;
+  dest->pub.free_in_buffer = size - dest->size;
+  dest->buffer = buffer;
+  dest->size = size;
+
+  return TRUE;
+}
+
+static void njtTermDestination(j_compress_ptr cinfo) {
+}
+
+void njtDestination(j_compress_ptr cinfo, struct njt_destination_mgr* dest) {
+  dest->pub.init_destination = njtInitDestination;
+  dest->pub.empty_output_buffer = njtEmptyOutputBuffer;
+  dest->pub.term_destination = njtTermDestination;
+  cinfo->dest = &dest->pub;
+}
+
+// Copies what has been written so far into an exactly sized buffer that
+// can be handed over to njtNewBuffer().
+int njtDestinationCopy(struct njt_destination_mgr* dest, unsigned char** dstData, unsigned long* dstLength) {
+  *dstLength = dest->size - dest->pub.free_in_buffer;
+  *dstData = tjAlloc(*dstLength);
+  if (*dstData == NULL) {
+    return -1;
+  }
+  memcpy(*dstData, dest->buffer, *dstLength);
+  return 0;
+}
+
+void njtReleaseDestination(struct njt_destination_mgr* dest) {
+  free(dest->buffer);
+  dest->buffer = NULL;
+  dest->size = 0;
+}
+
+int njtBytesPerPixel(uint32_t format) {
+  switch (format) {
+    case FORMAT_GRAY:
+      return 1;
+    case FORMAT_RGB:
+    case FORMAT_BGR:
+      return 3;
+    case FORMAT_RGBX:
+    case FORMAT_BGRX:
+    case FORMAT_XRGB:
+    case FORMAT_XBGR:
+    case FORMAT_RGBA:
+    case FORMAT_BGRA:
+    case FORMAT_ABGR:
+    case FORMAT_ARGB:
+      return 4;
+    default:
+      return 0;
+  }
+}
+
+J_COLOR_SPACE njtColorSpace(uint32_t format) {
+  switch (format) {
+    case FORMAT_RGB:
+      return JCS_EXT_RGB;
+    case FORMAT_BGR:
+      return JCS_EXT_BGR;
+    case FORMAT_RGBX:
+      return JCS_EXT_RGBX;
+    case FORMAT_BGRX:
+      return JCS_EXT_BGRX;
+    case FORMAT_XRGB:
+      return JCS_EXT_XRGB;
+    case FORMAT_XBGR:
+      return JCS_EXT_XBGR;
+    case FORMAT_GRAY:
+      return JCS_GRAYSCALE;
+    case FORMAT_RGBA:
+      return JCS_EXT_RGBA;
+    case FORMAT_BGRA:
+      return JCS_EXT_BGRA;
+    case FORMAT_ABGR:
+      return JCS_EXT_ABGR;
+    case FORMAT_ARGB:
+      return JCS_EXT_ARGB;
+    default:
+      return JCS_UNKNOWN;
+  }
+}
+
+// Same sampling factors that TurboJPEG uses for each subsampling method.
+void njtSetSubsampling(j_compress_ptr cinfo, uint32_t jpegSubsamp) {
+  int ci;
+
+  if (jpegSubsamp == SAMP_GRAY) {
+    jpeg_set_colorspace(cinfo, JCS_GRAYSCALE);
+  }
+  else {
+    jpeg_set_colorspace(cinfo, JCS_YCbCr);
+  }
+
+  cinfo->comp_info[0].h_samp_factor = (jpegSubsamp == SAMP_422 || jpegSubsamp == SAMP_420) ? 2 : 1;
+  cinfo->comp_info[0].v_samp_factor = (jpegSubsamp == SAMP_420 || jpegSubsamp == SAMP_440) ? 2 : 1;
+
+  for (ci = 1; ci < cinfo->num_components; ci++) {
+    cinfo->comp_info[ci].h_samp_factor = 1;
+    cinfo->comp_info[ci].v_samp_factor = 1;
+  }
+}
@@ -0,0 +1,431 @@
+#include "exports.h"
+
+#include <string.h>
+
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+static char errStr[NJT_MSG_LENGTH_MAX] = "No error";
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// Decodes only the luma channel. When libjpeg is asked for grayscale output
+// from a YCbCr image, it marks the chroma components as not needed, which
+// skips their IDCT, upsampling and color conversion; only the entropy
+// decoding remains. Combined with DCT scaling and with stopping right after
+// the last cropped row, this is much cheaper than a full decode.
+int decompressLuma(unsigned char* srcData, uint32_t srcLength, uint32_t scale, uint32_t cropX, uint32_t cropY, uint32_t cropWidth, uint32_t cropHeight, uint32_t maxPixels, uint64_t* reserved, int* width, int* height, uint32_t* dstLength, unsigned char** dstData, uint32_t dstBufferLength) {
+  int retval = 0;
+
+  struct jpeg_decompress_struct dinfo;
+  struct njt_error_mgr jerr;
+  JSAMPARRAY scratch;
+  JSAMPROW row;
+  JDIMENSION y;
+
+  memset(&dinfo, 0, sizeof(dinfo));
+  if (dstBufferLength == 0) {
+    *dstData = NULL;
+  }
+
+  dinfo.err = njtErrorMgr(&jerr);
+
+  if (setjmp(jerr.setjmp_buffer)) {
+    (*jerr.pub.format_message)((j_common_ptr) &dinfo, errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  jpeg_create_decompress(&dinfo);
+  jpeg_mem_src(&dinfo, srcData, srcLength);
+  jpeg_read_header(&dinfo, TRUE);
+
+  // Check the header dimensions before doing anything else
+  if (maxPixels > 0 && (uint64_t) dinfo.image_width * dinfo.image_height > maxPixels) {
+    _throw("Image exceeds pixel limit");
+  }
+
+  dinfo.out_color_space = JCS_GRAYSCALE;
+  dinfo.scale_num = 1;
+  dinfo.scale_denom = scale;
+  dinfo.dct_method = JDCT_IFAST;
+
+  jpeg_calc_output_dimensions(&dinfo);
+
+  // Crop is given in scaled coordinates, and defaults to the whole image
+  if (cropWidth == 0) {
+    cropWidth = cropX < dinfo.output_width ? dinfo.output_width - cropX : 0;
+  }
+  if (cropHeight == 0) {
+    cropHeight = cropY < dinfo.output_height ? dinfo.output_height - cropY : 0;
+  }
+  if (cropWidth == 0 || cropHeight == 0 ||
+      (uint64_t) cropX + cropWidth > dinfo.output_width ||
+      (uint64_t) cropY + cropHeight > dinfo.output_height) {
+    _throw("Crop region is outside the image");
+  }
+
+  // The pixel limit has already been checked against the full image
+  if (njtOutputLength(cropWidth, cropHeight, 1, 0, dstLength, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  *width = cropWidth;
+  *height = cropHeight;
+
+  if (dstBufferLength > 0) {
+    if (dstBufferLength < *dstLength) {
+      _throw("Insufficient output buffer");
+    }
+  }
+  else {
+    // Returns 1 when an async job has to wait for memory
+    retval = njtReserveMemory(*dstLength, reserved, errStr);
+    if (retval != 0) {
+      goto bailout;
+    }
+
+    *dstData = tjAlloc(*dstLength);
+    if (*dstData == NULL) {
+      njtReleaseMemory(*dstLength);
+      _throw("Out of memory");
+    }
+  }
+
+  jpeg_start_decompress(&dinfo);
+
+  // Rows above the crop and partial rows go through a scratch row. It's
+  // allocated from the image pool, so libjpeg frees it for us.
+  scratch = (*dinfo.mem->alloc_sarray)((j_common_ptr) &dinfo, JPOOL_IMAGE, dinfo.output_width, 1);
+
+  while (dinfo.output_scanline < cropY + cropHeight) {
+    y = dinfo.output_scanline;
+
+    if (y >= cropY && cropWidth == dinfo.output_width) {
+      row = *dstData + (size_t) (y - cropY) * cropWidth;
+      jpeg_read_scanlines(&dinfo, &row, 1);
+    }
+    else {
+      jpeg_read_scanlines(&dinfo, scratch, 1);
+      if (y >= cropY) {
+        memcpy(*dstData + (size_t) (y - cropY) * cropWidth, scratch[0] + cropX, cropWidth);
+      }
+    }
+  }
+
+  // Anything below the crop is never decoded. There's no need to finish
+  // decompression, jpeg_destroy_decompress() takes care of it.
+
+  bailout:
+  jpeg_destroy_decompress(&dinfo);
+
+  if (retval != 0 && dstBufferLength == 0 && *dstData != NULL) {
+    tjFree(*dstData);
+    *dstData = NULL;
+    njtReleaseMemory(*dstLength);
+  }
+
+  return retval;
+}
+
+class DecompressLumaWorker : public NJTBudgetWorker {
+  public:
+    DecompressLumaWorker(Callback *callback, Local<Object> &srcObject, unsigned char* srcData, uint32_t srcLength, uint32_t scale, uint32_t cropX, uint32_t cropY, uint32_t cropWidth, uint32_t cropHeight, uint32_t maxPixels, Local<Object> &dstObject, unsigned char* dstData, uint32_t dstBufferLength) :
+      NJTBudgetWorker(callback),
+      srcData(srcData),
+      srcLength(srcLength),
+      scale(scale),
+      cropX(cropX),
+      cropY(cropY),
+      cropWidth(cropWidth),
+      cropHeight(cropHeight),
+      maxPixels(maxPixels),
+      dstData(dstData),
+      dstBufferLength(dstBufferLength),
+      width(0),
+      height(0),
+      dstLength(0) {
+        SaveToPersistent("srcObject", srcObject);
+        if (dstBufferLength > 0) {
+          SaveToPersistent("dstObject", dstObject);
+        }
+      }
+
+    ~DecompressLumaWorker() {}
+
+    void Execute () {
+      int err;
+
+      err = decompressLuma(
+          this->srcData,
+          this->srcLength,
+          this->scale,
+          this->cropX,
+          this->cropY,
+          this->cropWidth,
+          this->cropHeight,
+          this->maxPixels,
+          &this->reserved,
+          &this->width,
+          &this->height,
+          &this->dstLength,
+          &this->dstData,
+          this->dstBufferLength);
+
+      if (err == 1) {
+        this->deferred = this->dstLength;
+      }
+      else if(err != 0) {
+        SetErrorMessage(errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      Local<Object> obj = New<Object>();
+      Local<Object> dstObject;
+
+      if (this->dstBufferLength > 0) {
+        dstObject = GetFromPersistent("dstObject").As<Object>();
+      }
+      else {
+        dstObject = njtNewBuffer(this->dstData, this->dstLength);
+        njtReleaseMemory(this->dstLength);
+      }
+
+      obj->Set(New("data").ToLocalChecked(), dstObject);
+      obj->Set(New("width").ToLocalChecked(), New(this->width));
+      obj->Set(New("height").ToLocalChecked(), New(this->height));
+      obj->Set(New("size").ToLocalChecked(), New(this->dstLength));
+      obj->Set(New("format").ToLocalChecked(), New(FORMAT_GRAY));
+
+      Local<Value> argv[] = {
+        Null(),
+        obj
+      };
+
+      callback->Call(2, argv);
+    }
+
+  private:
+    unsigned char* srcData;
+    uint32_t srcLength;
+    uint32_t scale;
+    uint32_t cropX;
+    uint32_t cropY;
+    uint32_t cropWidth;
+    uint32_t cropHeight;
+    uint32_t maxPixels;
+
+    unsigned char* dstData;
+    uint32_t dstBufferLength;
+    int width;
+    int height;
+    uint32_t dstLength;
+};
+
+void decompressLumaParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+  int retval = 0;
+  int cursor = 0;
+
+  // Input
+  Callback *callback = NULL;
+  Local<Object> srcObject;
+  unsigned char* srcData = NULL;
+  uint32_t srcLength = 0;
+  Local<Object> options;
+  Local<Value> scaleObject;
+  uint32_t scale = 1;
+  Local<Value> cropValue;
+  Local<Object> cropObject;
+  Local<Value> cropXObject;
+  uint32_t cropX = 0;
+  Local<Value> cropYObject;
+  uint32_t cropY = 0;
+  Local<Value> cropWidthObject;
+  uint32_t cropWidth = 0;
+  Local<Value> cropHeightObject;
+  uint32_t cropHeight = 0;
+  Local<Value> maxPixelsObject;
+  uint32_t maxPixels = 0;
+
+  // Output
+  Local<Object> dstObject;
+  uint32_t dstBufferLength = 0;
+  unsigned char* dstData = NULL;
+  int width;
+  int height;
+  uint32_t dstLength;
+
+  // Try to find callback here, so if we want to throw something we can use callback's err
+  if (async) {
+    if (info[info.Length() - 1]->IsFunction()) {
+      callback = new Callback(info[info.Length() - 1].As<Function>());
+    }
+    else {
+      _throw("Missing callback");
+    }
+  }
+
+  if ((async && info.Length() < 2) || (!async && info.Length() < 1)) {
+    _throw("Too few arguments");
+  }
+
+  // Input buffer
+  srcObject = info[cursor++].As<Object>();
+  if (!Buffer::HasInstance(srcObject)) {
+    _throw("Invalid source buffer");
+  }
+
+  srcData = (unsigned char*) Buffer::Data(srcObject);
+  srcLength = Buffer::Length(srcObject);
+
+  // Options
+  options = info[cursor++].As<Object>();
+
+  // Check if options we just got is actually the destination buffer
+  // If it is, pull new object from info and set that as options
+  if (Buffer::HasInstance(options) && info.Length() > cursor) {
+    dstObject = options;
+    options = info[cursor++].As<Object>();
+    dstBufferLength = Buffer::Length(dstObject);
+    dstData = (unsigned char*) Buffer::Data(dstObject);
+  }
+
+  // Options are optional
+  if (options->IsObject() && !options->IsFunction()) {
+    // DCT scaling, decodes at 1/scale of the original size
+    scaleObject = options->Get(New("scale").ToLocalChecked());
+    if (!scaleObject->IsUndefined()) {
+      if (!scaleObject->IsUint32()) {
+        _throw("Invalid scale value");
+      }
+      scale = scaleObject->Uint32Value();
+      switch (scale) {
+        case 1:
+        case 2:
+        case 4:
+        case 8:
+          break;
+        default:
+          _throw("Invalid scale value");
+      }
+    }
+
+    // Crop region in scaled coordinates
+    cropValue = options->Get(New("crop").ToLocalChecked());
+    if (!cropValue->IsUndefined()) {
+      if (!cropValue->IsObject()) {
+        _throw("Crop must be an object");
+      }
+      cropObject = cropValue.As<Object>();
+
+      cropXObject = cropObject->Get(New("x").ToLocalChecked());
+      if (!cropXObject->IsUndefined()) {
+        if (!cropXObject->IsUint32()) {
+          _throw("Invalid crop x value");
+        }
+        cropX = cropXObject->Uint32Value();
+      }
+
+      cropYObject = cropObject->Get(New("y").ToLocalChecked());
+      if (!cropYObject->IsUndefined()) {
+        if (!cropYObject->IsUint32()) {
+          _throw("Invalid crop y value");
+        }
+        cropY = cropYObject->Uint32Value();
+      }
+
+      cropWidthObject = cropObject->Get(New("width").ToLocalChecked());
+      if (!cropWidthObject->IsUndefined()) {
+        if (!cropWidthObject->IsUint32() || cropWidthObject->Uint32Value() == 0) {
+          _throw("Invalid crop width value");
+        }
+        cropWidth = cropWidthObject->Uint32Value();
+      }
+
+      cropHeightObject = cropObject->Get(New("height").ToLocalChecked());
+      if (!cropHeightObject->IsUndefined()) {
+        if (!cropHeightObject->IsUint32() || cropHeightObject->Uint32Value() == 0) {
+          _throw("Invalid crop height value");
+        }
+        cropHeight = cropHeightObject->Uint32Value();
+      }
+    }
+
+    // Refuse to decode images with more pixels than this
+    maxPixelsObject = options->Get(New("maxPixels").ToLocalChecked());
+    if (!maxPixelsObject->IsUndefined()) {
+      if (!maxPixelsObject->IsUint32()) {
+        _throw("Invalid maxPixels value");
+      }
+      maxPixels = maxPixelsObject->Uint32Value();
+    }
+  }
+
+  // Do either async or sync decompress
+  if (async) {
+    AsyncQueueWorker(new DecompressLumaWorker(callback, srcObject, srcData, srcLength, scale, cropX, cropY, cropWidth, cropHeight, maxPixels, dstObject, dstData, dstBufferLength));
+    return;
+  }
+  else {
+    retval = decompressLuma(
+        srcData,
+        srcLength,
+        scale,
+        cropX,
+        cropY,
+        cropWidth,
+        cropHeight,
+        maxPixels,
+        NULL,
+        &width,
+        &height,
+        &dstLength,
+        &dstData,
+        dstBufferLength);
+
+    if(retval != 0) {
+      // decompressLuma will set the errStr
+      goto bailout;
+    }
+    Local<Object> obj = New<Object>();
+
+    if (dstBufferLength == 0) {
+      dstObject = njtNewBuffer(dstData, dstLength);
+      njtReleaseMemory(dstLength);
+    }
+
+    obj->Set(New("data").ToLocalChecked(), dstObject);
+    obj->Set(New("width").ToLocalChecked(), New(width));
+    obj->Set(New("height").ToLocalChecked(), New(height));
+    obj->Set(New("size").ToLocalChecked(), New(dstLength));
+    obj->Set(New("format").ToLocalChecked(), New(FORMAT_GRAY));
+
+    info.GetReturnValue().Set(obj);
+    return;
+  }
+
+  // If we have error throw error or call callback with error
+  bailout:
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+NAN_METHOD(DecompressLumaSync) {
+  decompressLumaParse(info, false);
+}
+
+NAN_METHOD(DecompressLuma) {
+  decompressLumaParse(info, true);
+}
@@ -0,0 +1,256 @@
+#include "exports.h"
+
+#include <limits.h>
+#include <math.h>
+#include <algorithm>
+
+using namespace Nan;
+using namespace v8;
+
+static char errStr[NJT_MSG_LENGTH_MAX] = "No error";
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// Number.MAX_SAFE_INTEGER
+#define NJT_MAX_SAFE_INTEGER 9007199254740991.0
+
+// Budget for native memory that has been allocated for output but not yet
+// handed over to JS. Zero means unlimited.
+static uv_mutex_t memoryMutex;
+static uint64_t memoryBudget = 0;
+static uint64_t memoryInUse = 0;
+
+// Async jobs that are waiting for room in the budget, in arrival order. Only
+// touched on the main thread.
+static std::deque<NJTBudgetWorker*> memoryWaiters;
+static uv_async_t memoryAsync;
+
+static void njtResumeWorkers(uv_async_t* handle);
+
+void njtInitMemory() {
+  static bool initialized = false;
+
+  if (!initialized) {
+    uv_mutex_init(&memoryMutex);
+    uv_async_init(uv_default_loop(), &memoryAsync, njtResumeWorkers);
+    // Only keeps the loop alive while there are waiters
+    uv_unref((uv_handle_t*) &memoryAsync);
+    initialized = true;
+  }
+}
+
+// Reserves room for an allocation of the given size. Sync callers pass NULL
+// for reserved, and fail right away if the budget is currently exhausted.
+// Async callers pass the memory their job already holds (see
+// NJTBudgetWorker), and get 1 back if there's no room, in which case the job
+// should be deferred.
+int njtReserveMemory(uint64_t bytes, uint64_t* reserved, char* errStr) {
+  int retval = 0;
+  uint64_t held = 0;
+
+  // Memory set aside on the main thread while the job was parked is used
+  // up here, whether it's still enough or not
+  if (reserved != NULL) {
+    held = *reserved;
+    *reserved = 0;
+  }
+
+  uv_mutex_lock(&memoryMutex);
+
+  memoryInUse -= held;
+
+  if (memoryBudget > 0) {
+    if (bytes > memoryBudget) {
+      snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Image exceeds memory budget");
+      retval = -1;
+    }
+    else if (memoryInUse + bytes > memoryBudget) {
+      if (reserved != NULL) {
+        retval = 1;
+      }
+      else {
+        snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Memory budget exceeded");
+        retval = -1;
+      }
+    }
+  }
+
+  if (retval == 0) {
+    memoryInUse += bytes;
+  }
+
+  uv_mutex_unlock(&memoryMutex);
+
+  if (held > 0 && retval != 0) {
+    uv_async_send(&memoryAsync);
+  }
+
+  return retval;
+}
+
+// May be called from any thread. Waiters are resumed on the main thread.
+void njtReleaseMemory(uint64_t bytes) {
+  uv_mutex_lock(&memoryMutex);
+  memoryInUse -= bytes;
+  uv_mutex_unlock(&memoryMutex);
+
+  uv_async_send(&memoryAsync);
+}
+
+// Resumes parked jobs in arrival order for as long as they fit, so that a
+// large image isn't starved by smaller ones behind it. Jobs that can no
+// longer fit at all fail.
+static void njtResumeWorkers(uv_async_t* handle) {
+  NJTBudgetWorker* worker;
+  bool fits;
+
+  while (!memoryWaiters.empty()) {
+    worker = memoryWaiters.front();
+
+    uv_mutex_lock(&memoryMutex);
+    if (memoryBudget > 0 && worker->deferred > memoryBudget) {
+      uv_mutex_unlock(&memoryMutex);
+      memoryWaiters.pop_front();
+      worker->Reject("Image exceeds memory budget");
+      continue;
+    }
+    fits = memoryBudget == 0 || memoryInUse + worker->deferred <= memoryBudget;
+    if (fits) {
+      memoryInUse += worker->deferred;
+    }
+    uv_mutex_unlock(&memoryMutex);
+
+    if (!fits) {
+      break;
+    }
+
+    memoryWaiters.pop_front();
+    worker->Resume(worker->deferred);
+  }
+
+  if (memoryWaiters.empty()) {
+    uv_unref((uv_handle_t*) &memoryAsync);
+  }
+}
+
+void NJTBudgetWorker::WorkComplete() {
+  if (this->deferred > 0) {
+    // Memory may have been released after Execute() gave up, so check
+    // again right away rather than waiting for the next release
+    memoryWaiters.push_back(this);
+    uv_ref((uv_handle_t*) &memoryAsync);
+    uv_async_send(&memoryAsync);
+    return;
+  }
+
+  // Execute() may have failed before it got to use the memory reserved
+  // while the worker was parked, for example if a file became unreadable
+  if (this->reserved > 0) {
+    njtReleaseMemory(this->reserved);
+    this->reserved = 0;
+  }
+
+  AsyncWorker::WorkComplete();
+}
+
+void NJTBudgetWorker::Destroy() {
+  // A parked worker is queued again later
+  if (this->deferred == 0) {
+    AsyncWorker::Destroy();
+  }
+}
+
+void NJTBudgetWorker::Resume(uint64_t bytes) {
+  this->deferred = 0;
+  this->reserved = bytes;
+  AsyncQueueWorker(this);
+}
+
+void NJTBudgetWorker::Reject(const char* message) {
+  this->deferred = 0;
+  SetErrorMessage(message);
+  AsyncWorker::WorkComplete();
+  AsyncWorker::Destroy();
+}
+
+// Checks the header dimensions of an image before anything is allocated for
+// it, as a tiny crafted image may claim to be enormous. The output has to
+// fit in a Buffer as well as in the uint32_t that carries its length around.
+int njtOutputLength(uint32_t width, uint32_t height, int bpp, uint32_t maxPixels, uint32_t* length, char* errStr) {
+  uint64_t pixels = (uint64_t) width * height;
+  uint64_t limit = std::min<uint64_t>(node::Buffer::kMaxLength, UINT32_MAX);
+
+  if (maxPixels > 0 && pixels > maxPixels) {
+    snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Image exceeds pixel limit");
+    return -1;
+  }
+
+  if (pixels > limit / bpp) {
+    snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", "Image is too large");
+    return -1;
+  }
+
+  *length = (uint32_t) (pixels * bpp);
+
+  return 0;
+}
+
+static void njtBufferFreeCallback(char* data, void* hint) {
+  AdjustExternalMemory(-(int) (size_t) hint);
+  tjFree((unsigned char*) data);
+}
+
+// Wraps memory allocated with tjAlloc() in a Buffer, reporting it to V8 so
+// that GC pacing takes the native allocation into account. The change has
+// to fit in an int, so buffers of 2 GiB or more are reported as INT_MAX,
+// and the same amount is taken off again when the buffer is freed.
+Local<Object> njtNewBuffer(unsigned char* data, uint32_t length) {
+  size_t reported = std::min<size_t>(length, INT_MAX);
+
+  AdjustExternalMemory((int) reported);
+  return NewBuffer((char*) data, length, njtBufferFreeCallback, (void*) reported).ToLocalChecked();
+}
+
+NAN_METHOD(SetMemoryBudget) {
+  int retval = 0;
+  Local<Value> budgetObject;
+  double budget;
+
+  if (info.Length() < 1) {
+    _throw("Too few arguments");
+  }
+
+  // NaN and Infinity are numbers too, and can't be converted to an integer.
+  // Anything up to 2^53 is exact as a double and fits in a uint64_t.
+  budgetObject = info[0];
+  if (!budgetObject->IsNumber()) {
+    _throw("Invalid memory budget");
+  }
+  budget = budgetObject->NumberValue();
+  if (!(budget >= 0 && budget <= NJT_MAX_SAFE_INTEGER) || floor(budget) != budget) {
+    _throw("Invalid memory budget");
+  }
+
+  uv_mutex_lock(&memoryMutex);
+  memoryBudget = (uint64_t) budget;
+  uv_mutex_unlock(&memoryMutex);
+
+  // Parked jobs may fit now, or may never fit anymore
+  uv_async_send(&memoryAsync);
+
+  bailout:
+  if (retval != 0) {
+    ThrowError(TypeError(errStr));
+    return;
+  }
+}
+
+NAN_METHOD(MemoryUsage) {
+  Local<Object> obj = New<Object>();
+
+  uv_mutex_lock(&memoryMutex);
+  obj->Set(New("budget").ToLocalChecked(), New((double) memoryBudget));
+  obj->Set(New("inUse").ToLocalChecked(), New((double) memoryInUse));
+  uv_mutex_unlock(&memoryMutex);
+
+  info.GetReturnValue().Set(obj);
+}
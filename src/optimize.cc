@@ -0,0 +1,254 @@
+#include "exports.h"
+
+#include <string.h>
+
+extern "C" {
+#include <transupp.h>
+}
+
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+static char errStr[NJT_MSG_LENGTH_MAX] = "No error";
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// Rewrites the image with optimized Huffman tables (and optionally as
+// progressive) without decoding it, like jpegtran -optimize. The quantized
+// DCT coefficients are copied as is, so there's no generation loss.
+int optimize(unsigned char* srcData, uint32_t srcLength, bool progressive, bool strip, uint32_t maxPixels, unsigned char** dstData, unsigned long* dstLength) {
+  int retval = 0;
+
+  struct jpeg_decompress_struct srcinfo;
+  struct jpeg_compress_struct dstinfo;
+  struct njt_error_mgr jerr;
+  struct njt_destination_mgr dest;
+  jvirt_barray_ptr* coefArrays;
+  JCOPY_OPTION copyOption = strip ? JCOPYOPT_NONE : JCOPYOPT_ALL;
+
+  memset(&srcinfo, 0, sizeof(srcinfo));
+  memset(&dstinfo, 0, sizeof(dstinfo));
+  memset(&dest, 0, sizeof(dest));
+
+  srcinfo.err = njtErrorMgr(&jerr);
+  dstinfo.err = &jerr.pub;
+
+  if (setjmp(jerr.setjmp_buffer)) {
+    (*jerr.pub.format_message)((j_common_ptr) &srcinfo, errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  jpeg_create_decompress(&srcinfo);
+  jpeg_create_compress(&dstinfo);
+
+  jpeg_mem_src(&srcinfo, srcData, srcLength);
+  jcopy_markers_setup(&srcinfo, copyOption);
+  jpeg_read_header(&srcinfo, TRUE);
+
+  // The coefficients of the whole image are kept in memory
+  if (maxPixels > 0 && (uint64_t) srcinfo.image_width * srcinfo.image_height > maxPixels) {
+    _throw("Image exceeds pixel limit");
+  }
+
+  coefArrays = jpeg_read_coefficients(&srcinfo);
+
+  jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
+  dstinfo.optimize_coding = TRUE;
+  if (progressive) {
+    jpeg_simple_progression(&dstinfo);
+  }
+
+  njtDestination(&dstinfo, &dest);
+  jpeg_write_coefficients(&dstinfo, coefArrays);
+  jcopy_markers_execute(&srcinfo, &dstinfo, copyOption);
+
+  jpeg_finish_compress(&dstinfo);
+  jpeg_finish_decompress(&srcinfo);
+
+  if (njtDestinationCopy(&dest, dstData, dstLength) != 0) {
+    _throw("Out of memory");
+  }
+
+  bailout:
+  jpeg_destroy_compress(&dstinfo);
+  jpeg_destroy_decompress(&srcinfo);
+  njtReleaseDestination(&dest);
+
+  return retval;
+}
+
+class OptimizeWorker : public AsyncWorker {
+  public:
+    OptimizeWorker(Callback *callback, Local<Object> &srcObject, unsigned char* srcData, uint32_t srcLength, bool progressive, bool strip, uint32_t maxPixels) :
+      AsyncWorker(callback),
+      srcData(srcData),
+      srcLength(srcLength),
+      progressive(progressive),
+      strip(strip),
+      maxPixels(maxPixels),
+      dstData(NULL),
+      dstLength(0) {
+        SaveToPersistent("srcObject", srcObject);
+      }
+    ~OptimizeWorker() {}
+
+    void Execute () {
+      int err;
+
+      err = optimize(
+          this->srcData,
+          this->srcLength,
+          this->progressive,
+          this->strip,
+          this->maxPixels,
+          &this->dstData,
+          &this->dstLength);
+
+      if(err != 0) {
+        SetErrorMessage(errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      Local<Value> argv[] = {
+        Null(),
+        njtNewBuffer(this->dstData, this->dstLength)
+      };
+
+      callback->Call(2, argv);
+    }
+
+  private:
+    unsigned char* srcData;
+    uint32_t srcLength;
+    bool progressive;
+    bool strip;
+    uint32_t maxPixels;
+
+    unsigned char* dstData;
+    unsigned long dstLength;
+};
+
+void optimizeParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+  int retval = 0;
+  int cursor = 0;
+
+  // Input
+  Callback *callback = NULL;
+  Local<Object> srcObject;
+  unsigned char* srcData = NULL;
+  uint32_t srcLength = 0;
+  Local<Object> options;
+  Local<Value> progressiveObject;
+  bool progressive = false;
+  Local<Value> stripObject;
+  bool strip = false;
+  Local<Value> maxPixelsObject;
+  uint32_t maxPixels = 0;
+
+  // Output
+  unsigned char* dstData = NULL;
+  unsigned long dstLength = 0;
+
+  // Try to find callback here, so if we want to throw something we can use callback's err
+  if (async) {
+    if (info[info.Length() - 1]->IsFunction()) {
+      callback = new Callback(info[info.Length() - 1].As<Function>());
+    }
+    else {
+      _throw("Missing callback");
+    }
+  }
+
+  if ((async && info.Length() < 2) || (!async && info.Length() < 1)) {
+    _throw("Too few arguments");
+  }
+
+  // Input buffer
+  srcObject = info[cursor++].As<Object>();
+  if (!Buffer::HasInstance(srcObject)) {
+    _throw("Invalid source buffer");
+  }
+
+  srcData = (unsigned char*) Buffer::Data(srcObject);
+  srcLength = Buffer::Length(srcObject);
+
+  // Options are optional
+  options = info[cursor++].As<Object>();
+  if (options->IsObject() && !options->IsFunction()) {
+    // Whether to write a progressive JPEG
+    progressiveObject = options->Get(New("progressive").ToLocalChecked());
+    if (!progressiveObject->IsUndefined()) {
+      if (!progressiveObject->IsBoolean()) {
+        _throw("Invalid progressive value");
+      }
+      progressive = progressiveObject->BooleanValue();
+    }
+
+    // Whether to drop EXIF, ICC profiles, comments and other markers
+    stripObject = options->Get(New("strip").ToLocalChecked());
+    if (!stripObject->IsUndefined()) {
+      if (!stripObject->IsBoolean()) {
+        _throw("Invalid strip value");
+      }
+      strip = stripObject->BooleanValue();
+    }
+
+    // Refuse to process images with more pixels than this
+    maxPixelsObject = options->Get(New("maxPixels").ToLocalChecked());
+    if (!maxPixelsObject->IsUndefined()) {
+      if (!maxPixelsObject->IsUint32()) {
+        _throw("Invalid maxPixels value");
+      }
+      maxPixels = maxPixelsObject->Uint32Value();
+    }
+  }
+
+  // Do either async or sync optimize
+  if (async) {
+    AsyncQueueWorker(new OptimizeWorker(callback, srcObject, srcData, srcLength, progressive, strip, maxPixels));
+    return;
+  }
+  else {
+    retval = optimize(
+        srcData,
+        srcLength,
+        progressive,
+        strip,
+        maxPixels,
+        &dstData,
+        &dstLength);
+
+    if(retval != 0) {
+      // optimize will set the errStr
+      goto bailout;
+    }
+
+    info.GetReturnValue().Set(njtNewBuffer(dstData, dstLength));
+    return;
+  }
+
+  // If we have error throw error or call callback with error
+  bailout:
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+NAN_METHOD(OptimizeSync) {
+  optimizeParse(info, false);
+}
+
+NAN_METHOD(Optimize) {
+  optimizeParse(info, true);
+}
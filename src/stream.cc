@@ -0,0 +1,861 @@
+#include "exports.h"
+
+#include <string.h>
+
+using namespace Nan;
+using namespace v8;
+using namespace node;
+
+static char errStr[NJT_MSG_LENGTH_MAX] = "No error";
+#define _throw(m) {snprintf(errStr, NJT_MSG_LENGTH_MAX, "%s", m); retval=-1; goto bailout;}
+
+// Compresses a stream of equally sized frames with a single set of
+// quantization and Huffman tables. The tables are written once (either by
+// tables() or as part of the first frame), after which frames are written
+// as abbreviated datastreams that leave them out.
+class StreamCompressor : public ObjectWrap {
+  public:
+    static NAN_MODULE_INIT(Init);
+
+    int Tables(unsigned char** dstData, unsigned long* jpegSize);
+    int Compress(unsigned char* srcData, unsigned char** dstData, unsigned long* jpegSize);
+
+    void Acquire() {
+      this->busy = true;
+      Ref();
+    }
+
+    void Release() {
+      this->busy = false;
+      Unref();
+    }
+
+    bool busy;
+    uint32_t format;
+    uint32_t width;
+    uint32_t stride;
+    uint32_t height;
+
+  private:
+    StreamCompressor(uint32_t format, uint32_t width, uint32_t stride, uint32_t height) :
+      busy(false),
+      format(format),
+      width(width),
+      stride(stride),
+      height(height) {
+        memset(&this->cinfo, 0, sizeof(this->cinfo));
+        memset(&this->dest, 0, sizeof(this->dest));
+      }
+
+    ~StreamCompressor() {
+      jpeg_destroy_compress(&this->cinfo);
+      njtReleaseDestination(&this->dest);
+    }
+
+    int Setup(uint32_t jpegSubsamp, int quality);
+
+    static NAN_METHOD(JsNew);
+    static NAN_METHOD(JsTables);
+    static NAN_METHOD(JsCompressSync);
+    static NAN_METHOD(JsCompress);
+
+    struct jpeg_compress_struct cinfo;
+    struct njt_error_mgr jerr;
+    struct njt_destination_mgr dest;
+};
+
+int StreamCompressor::Setup(uint32_t jpegSubsamp, int quality) {
+  int retval = 0;
+
+  this->cinfo.err = njtErrorMgr(&this->jerr);
+
+  if (setjmp(this->jerr.setjmp_buffer)) {
+    (*this->cinfo.err->format_message)((j_common_ptr) &this->cinfo, errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  jpeg_create_compress(&this->cinfo);
+  njtDestination(&this->cinfo, &this->dest);
+
+  this->cinfo.image_width = this->width;
+  this->cinfo.image_height = this->height;
+  this->cinfo.input_components = njtBytesPerPixel(this->format);
+  this->cinfo.in_color_space = njtColorSpace(this->format);
+
+  jpeg_set_defaults(&this->cinfo);
+  njtSetSubsampling(&this->cinfo, this->format == FORMAT_GRAY ? (uint32_t) SAMP_GRAY : jpegSubsamp);
+  jpeg_set_quality(&this->cinfo, quality, TRUE);
+
+  // Same as TJFLAG_FASTDCT. Optimized Huffman tables would differ between
+  // frames, so they can't be used with shared tables.
+  this->cinfo.dct_method = JDCT_IFAST;
+  this->cinfo.optimize_coding = FALSE;
+
+  // Frames are only meaningful together with the tables, skip the JFIF
+  // marker as well
+  this->cinfo.write_JFIF_header = FALSE;
+
+  bailout:
+  return retval;
+}
+
+int StreamCompressor::Tables(unsigned char** dstData, unsigned long* jpegSize) {
+  int retval = 0;
+
+  if (setjmp(this->jerr.setjmp_buffer)) {
+    (*this->cinfo.err->format_message)((j_common_ptr) &this->cinfo, errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  // The first tables() call or frame marks every table as sent, after which
+  // jpeg_write_tables() would skip them all. A decoder that joins late needs
+  // them again.
+  jpeg_suppress_tables(&this->cinfo, FALSE);
+  jpeg_write_tables(&this->cinfo);
+
+  if (njtDestinationCopy(&this->dest, dstData, jpegSize) != 0) {
+    _throw("Out of memory");
+  }
+
+  bailout:
+  if (retval != 0) {
+    jpeg_abort_compress(&this->cinfo);
+  }
+
+  return retval;
+}
+
+int StreamCompressor::Compress(unsigned char* srcData, unsigned char** dstData, unsigned long* jpegSize) {
+  int retval = 0;
+  int bpp = njtBytesPerPixel(this->format);
+  JSAMPROW row;
+
+  if (setjmp(this->jerr.setjmp_buffer)) {
+    (*this->cinfo.err->format_message)((j_common_ptr) &this->cinfo, errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  // Only tables that haven't been written yet are included
+  jpeg_start_compress(&this->cinfo, FALSE);
+
+  while (this->cinfo.next_scanline < this->cinfo.image_height) {
+    row = srcData + (size_t) this->cinfo.next_scanline * this->stride * bpp;
+    jpeg_write_scanlines(&this->cinfo, &row, 1);
+  }
+
+  jpeg_finish_compress(&this->cinfo);
+
+  if (njtDestinationCopy(&this->dest, dstData, jpegSize) != 0) {
+    _throw("Out of memory");
+  }
+
+  bailout:
+  if (retval != 0) {
+    jpeg_abort_compress(&this->cinfo);
+  }
+
+  return retval;
+}
+
+class StreamCompressWorker : public AsyncWorker {
+  public:
+    StreamCompressWorker(Callback *callback, StreamCompressor* stream, Local<Object> &srcObject, unsigned char* srcData) :
+      AsyncWorker(callback),
+      stream(stream),
+      srcData(srcData),
+      jpegSize(0),
+      dstData(NULL) {
+        SaveToPersistent("srcObject", srcObject);
+        stream->Acquire();
+      }
+    ~StreamCompressWorker() {}
+
+    void Execute () {
+      int err;
+
+      err = this->stream->Compress(this->srcData, &this->dstData, &this->jpegSize);
+
+      if(err != 0) {
+        SetErrorMessage(errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      this->stream->Release();
+
+      Local<Value> argv[] = {
+        Null(),
+        njtNewBuffer(this->dstData, this->jpegSize)
+      };
+
+      callback->Call(2, argv);
+    }
+
+    void HandleErrorCallback () {
+      this->stream->Release();
+      AsyncWorker::HandleErrorCallback();
+    }
+
+  private:
+    StreamCompressor* stream;
+    unsigned char* srcData;
+    unsigned long jpegSize;
+    unsigned char* dstData;
+};
+
+NAN_MODULE_INIT(StreamCompressor::Init) {
+  Local<FunctionTemplate> tpl = New<FunctionTemplate>(JsNew);
+  tpl->SetClassName(New("StreamCompressor").ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+  SetPrototypeMethod(tpl, "tables", JsTables);
+  SetPrototypeMethod(tpl, "compressSync", JsCompressSync);
+  SetPrototypeMethod(tpl, "compress", JsCompress);
+
+  Set(target, New("StreamCompressor").ToLocalChecked(), GetFunction(tpl).ToLocalChecked());
+}
+
+NAN_METHOD(StreamCompressor::JsNew) {
+  int retval = 0;
+
+  StreamCompressor* stream = NULL;
+  Local<Object> options;
+  Local<Value> formatObject;
+  uint32_t format = 0;
+  Local<Value> sampObject;
+  uint32_t jpegSubsamp = NJT_DEFAULT_SUBSAMPLING;
+  Local<Value> widthObject;
+  uint32_t width = 0;
+  Local<Value> heightObject;
+  uint32_t height = 0;
+  Local<Value> strideObject;
+  uint32_t stride;
+  Local<Value> qualityObject;
+  int quality = NJT_DEFAULT_QUALITY;
+
+  if (!info.IsConstructCall()) {
+    _throw("Use the new operator to create a StreamCompressor");
+  }
+
+  if (info.Length() < 1) {
+    _throw("Too few arguments");
+  }
+
+  options = info[0].As<Object>();
+  if (!options->IsObject()) {
+    _throw("Options must be an object");
+  }
+
+  // Format of input buffers
+  formatObject = options->Get(New("format").ToLocalChecked());
+  if (formatObject->IsUndefined()) {
+    _throw("Missing format");
+  }
+  if (!formatObject->IsUint32() || njtBytesPerPixel(formatObject->Uint32Value()) == 0) {
+    _throw("Invalid input format");
+  }
+  format = formatObject->Uint32Value();
+
+  // Subsampling
+  sampObject = options->Get(New("subsampling").ToLocalChecked());
+  if (!sampObject->IsUndefined()) {
+    if (!sampObject->IsUint32()) {
+      _throw("Invalid subsampling method");
+    }
+    jpegSubsamp = sampObject->Uint32Value();
+  }
+
+  switch (jpegSubsamp) {
+    case SAMP_444:
+    case SAMP_422:
+    case SAMP_420:
+    case SAMP_GRAY:
+    case SAMP_440:
+      break;
+    default:
+      _throw("Invalid subsampling method");
+  }
+
+  // Width
+  widthObject = options->Get(New("width").ToLocalChecked());
+  if (widthObject->IsUndefined()) {
+    _throw("Missing width");
+  }
+  if (!widthObject->IsUint32() || widthObject->Uint32Value() == 0) {
+    _throw("Invalid width value");
+  }
+  width = widthObject->Uint32Value();
+
+  // Height
+  heightObject = options->Get(New("height").ToLocalChecked());
+  if (heightObject->IsUndefined()) {
+    _throw("Missing height");
+  }
+  if (!heightObject->IsUint32() || heightObject->Uint32Value() == 0) {
+    _throw("Invalid height value");
+  }
+  height = heightObject->Uint32Value();
+
+  // Stride
+  strideObject = options->Get(New("stride").ToLocalChecked());
+  if (!strideObject->IsUndefined()) {
+    if (!strideObject->IsUint32() || strideObject->Uint32Value() < width) {
+      _throw("Invalid stride value");
+    }
+    stride = strideObject->Uint32Value();
+  }
+  else {
+    stride = width;
+  }
+
+  // Quality
+  qualityObject = options->Get(New("quality").ToLocalChecked());
+  if (!qualityObject->IsUndefined()) {
+    if (!qualityObject->IsUint32() || qualityObject->Uint32Value() > 100) {
+      _throw("Invalid quality value");
+    }
+    quality = qualityObject->Uint32Value();
+  }
+
+  stream = new StreamCompressor(format, width, stride, height);
+  if (stream->Setup(jpegSubsamp, quality) != 0) {
+    delete stream;
+    retval = -1;
+    goto bailout;
+  }
+
+  stream->Wrap(info.This());
+  info.GetReturnValue().Set(info.This());
+  return;
+
+  bailout:
+  if (retval != 0) {
+    ThrowError(TypeError(errStr));
+    return;
+  }
+}
+
+NAN_METHOD(StreamCompressor::JsTables) {
+  int retval = 0;
+  StreamCompressor* stream = ObjectWrap::Unwrap<StreamCompressor>(info.Holder());
+  unsigned char* dstData = NULL;
+  unsigned long jpegSize = 0;
+
+  if (stream->busy) {
+    _throw("Stream is busy");
+  }
+
+  retval = stream->Tables(&dstData, &jpegSize);
+  if (retval != 0) {
+    goto bailout;
+  }
+
+  info.GetReturnValue().Set(njtNewBuffer(dstData, jpegSize));
+  return;
+
+  bailout:
+  if (retval != 0) {
+    ThrowError(TypeError(errStr));
+    return;
+  }
+}
+
+void streamCompressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+  int retval = 0;
+
+  StreamCompressor* stream = ObjectWrap::Unwrap<StreamCompressor>(info.Holder());
+  Callback *callback = NULL;
+  Local<Object> srcObject;
+  unsigned char* srcData = NULL;
+  unsigned char* dstData = NULL;
+  unsigned long jpegSize = 0;
+
+  // Try to find callback here, so if we want to throw something we can use callback's err
+  if (async) {
+    if (info[info.Length() - 1]->IsFunction()) {
+      callback = new Callback(info[info.Length() - 1].As<Function>());
+    }
+    else {
+      _throw("Missing callback");
+    }
+  }
+
+  if ((async && info.Length() < 2) || (!async && info.Length() < 1)) {
+    _throw("Too few arguments");
+  }
+
+  // Frames share state, so only one may be in flight at a time
+  if (stream->busy) {
+    _throw("Stream is busy");
+  }
+
+  // Input buffer
+  srcObject = info[0].As<Object>();
+  if (!Buffer::HasInstance(srcObject)) {
+    _throw("Invalid source buffer");
+  }
+  if (Buffer::Length(srcObject) < (size_t) stream->stride * (stream->height - 1) * njtBytesPerPixel(stream->format) + (size_t) stream->width * njtBytesPerPixel(stream->format)) {
+    _throw("Insufficient source buffer");
+  }
+  srcData = (unsigned char*) Buffer::Data(srcObject);
+
+  if (async) {
+    AsyncQueueWorker(new StreamCompressWorker(callback, stream, srcObject, srcData));
+    return;
+  }
+  else {
+    retval = stream->Compress(srcData, &dstData, &jpegSize);
+    if (retval != 0) {
+      goto bailout;
+    }
+
+    info.GetReturnValue().Set(njtNewBuffer(dstData, jpegSize));
+    return;
+  }
+
+  // If we have error throw error or call callback with error
+  bailout:
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+NAN_METHOD(StreamCompressor::JsCompressSync) {
+  streamCompressParse(info, false);
+}
+
+NAN_METHOD(StreamCompressor::JsCompress) {
+  streamCompressParse(info, true);
+}
+
+// Decompresses frames produced by StreamCompressor. Tables are kept between
+// frames, so abbreviated frames decode as long as the tables have been seen
+// once, either via setTables() or as part of an earlier frame.
+class StreamDecompressor : public ObjectWrap {
+  public:
+    static NAN_MODULE_INIT(Init);
+
+    int SetTables(unsigned char* srcData, uint32_t srcLength);
+    int Decompress(unsigned char* srcData, uint32_t srcLength, uint64_t* reserved, int* width, int* height, uint32_t* dstLength, unsigned char** dstData);
+
+    void Acquire() {
+      this->busy = true;
+      Ref();
+    }
+
+    void Release() {
+      this->busy = false;
+      Unref();
+    }
+
+    bool busy;
+    uint32_t format;
+
+  private:
+    StreamDecompressor(uint32_t format, uint32_t maxPixels) :
+      busy(false),
+      format(format),
+      maxPixels(maxPixels) {
+        memset(&this->dinfo, 0, sizeof(this->dinfo));
+      }
+
+    ~StreamDecompressor() {
+      jpeg_destroy_decompress(&this->dinfo);
+    }
+
+    int Setup();
+
+    static NAN_METHOD(JsNew);
+    static NAN_METHOD(JsSetTables);
+    static NAN_METHOD(JsDecompressSync);
+    static NAN_METHOD(JsDecompress);
+
+    uint32_t maxPixels;
+    struct jpeg_decompress_struct dinfo;
+    struct njt_error_mgr jerr;
+};
+
+int StreamDecompressor::Setup() {
+  int retval = 0;
+
+  this->dinfo.err = njtErrorMgr(&this->jerr);
+
+  if (setjmp(this->jerr.setjmp_buffer)) {
+    (*this->dinfo.err->format_message)((j_common_ptr) &this->dinfo, errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  jpeg_create_decompress(&this->dinfo);
+
+  bailout:
+  return retval;
+}
+
+int StreamDecompressor::SetTables(unsigned char* srcData, uint32_t srcLength) {
+  int retval = 0;
+
+  if (setjmp(this->jerr.setjmp_buffer)) {
+    (*this->dinfo.err->format_message)((j_common_ptr) &this->dinfo, errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  jpeg_mem_src(&this->dinfo, srcData, srcLength);
+
+  // A full image works too, we just don't need the rest of it
+  if (jpeg_read_header(&this->dinfo, FALSE) == JPEG_HEADER_OK) {
+    jpeg_abort_decompress(&this->dinfo);
+  }
+
+  // An empty SOI+EOI stream is valid, but useless
+  if (this->dinfo.quant_tbl_ptrs[0] == NULL) {
+    _throw("No tables found");
+  }
+
+  bailout:
+  if (retval != 0) {
+    jpeg_abort_decompress(&this->dinfo);
+  }
+
+  return retval;
+}
+
+int StreamDecompressor::Decompress(unsigned char* srcData, uint32_t srcLength, uint64_t* reserved, int* width, int* height, uint32_t* dstLength, unsigned char** dstData) {
+  int retval = 0;
+  int bpp = njtBytesPerPixel(this->format);
+  JSAMPROW row;
+
+  *dstData = NULL;
+
+  if (setjmp(this->jerr.setjmp_buffer)) {
+    (*this->dinfo.err->format_message)((j_common_ptr) &this->dinfo, errStr);
+    retval = -1;
+    goto bailout;
+  }
+
+  jpeg_mem_src(&this->dinfo, srcData, srcLength);
+  jpeg_read_header(&this->dinfo, TRUE);
+
+  *width = this->dinfo.image_width;
+  *height = this->dinfo.image_height;
+
+  if (njtOutputLength(*width, *height, bpp, this->maxPixels, dstLength, errStr) != 0) {
+    retval = -1;
+    goto bailout;
+  }
+
+  // Returns 1 when an async job has to wait for memory
+  retval = njtReserveMemory(*dstLength, reserved, errStr);
+  if (retval != 0) {
+    goto bailout;
+  }
+
+  *dstData = tjAlloc(*dstLength);
+  if (*dstData == NULL) {
+    njtReleaseMemory(*dstLength);
+    _throw("Out of memory");
+  }
+
+  this->dinfo.out_color_space = njtColorSpace(this->format);
+  this->dinfo.dct_method = JDCT_IFAST;
+
+  jpeg_start_decompress(&this->dinfo);
+
+  while (this->dinfo.output_scanline < this->dinfo.output_height) {
+    row = *dstData + (size_t) this->dinfo.output_scanline * *width * bpp;
+    jpeg_read_scanlines(&this->dinfo, &row, 1);
+  }
+
+  jpeg_finish_decompress(&this->dinfo);
+
+  bailout:
+  if (retval != 0) {
+    // Tables survive an abort
+    jpeg_abort_decompress(&this->dinfo);
+
+    if (*dstData != NULL) {
+      tjFree(*dstData);
+      *dstData = NULL;
+      njtReleaseMemory(*dstLength);
+    }
+  }
+
+  return retval;
+}
+
+class StreamDecompressWorker : public NJTBudgetWorker {
+  public:
+    StreamDecompressWorker(Callback *callback, StreamDecompressor* stream, Local<Object> &srcObject, unsigned char* srcData, uint32_t srcLength) :
+      NJTBudgetWorker(callback),
+      stream(stream),
+      srcData(srcData),
+      srcLength(srcLength),
+      dstData(NULL),
+      width(0),
+      height(0),
+      dstLength(0) {
+        SaveToPersistent("srcObject", srcObject);
+        stream->Acquire();
+      }
+    ~StreamDecompressWorker() {}
+
+    void Execute () {
+      int err;
+
+      err = this->stream->Decompress(
+          this->srcData,
+          this->srcLength,
+          &this->reserved,
+          &this->width,
+          &this->height,
+          &this->dstLength,
+          &this->dstData);
+
+      if (err == 1) {
+        this->deferred = this->dstLength;
+      }
+      else if(err != 0) {
+        SetErrorMessage(errStr);
+      }
+    }
+
+    void HandleOKCallback () {
+      Local<Object> obj = New<Object>();
+
+      this->stream->Release();
+
+      obj->Set(New("data").ToLocalChecked(), njtNewBuffer(this->dstData, this->dstLength));
+      njtReleaseMemory(this->dstLength);
+      obj->Set(New("width").ToLocalChecked(), New(this->width));
+      obj->Set(New("height").ToLocalChecked(), New(this->height));
+      obj->Set(New("size").ToLocalChecked(), New(this->dstLength));
+      obj->Set(New("format").ToLocalChecked(), New(this->stream->format));
+
+      Local<Value> argv[] = {
+        Null(),
+        obj
+      };
+
+      callback->Call(2, argv);
+    }
+
+    void HandleErrorCallback () {
+      this->stream->Release();
+      AsyncWorker::HandleErrorCallback();
+    }
+
+  private:
+    StreamDecompressor* stream;
+    unsigned char* srcData;
+    uint32_t srcLength;
+
+    unsigned char* dstData;
+    int width;
+    int height;
+    uint32_t dstLength;
+};
+
+NAN_MODULE_INIT(StreamDecompressor::Init) {
+  Local<FunctionTemplate> tpl = New<FunctionTemplate>(JsNew);
+  tpl->SetClassName(New("StreamDecompressor").ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+  SetPrototypeMethod(tpl, "setTables", JsSetTables);
+  SetPrototypeMethod(tpl, "decompressSync", JsDecompressSync);
+  SetPrototypeMethod(tpl, "decompress", JsDecompress);
+
+  Set(target, New("StreamDecompressor").ToLocalChecked(), GetFunction(tpl).ToLocalChecked());
+}
+
+NAN_METHOD(StreamDecompressor::JsNew) {
+  int retval = 0;
+
+  StreamDecompressor* stream = NULL;
+  Local<Object> options;
+  Local<Value> formatObject;
+  uint32_t format = NJT_DEFAULT_FORMAT;
+  Local<Value> maxPixelsObject;
+  uint32_t maxPixels = 0;
+
+  if (!info.IsConstructCall()) {
+    _throw("Use the new operator to create a StreamDecompressor");
+  }
+
+  // Options are optional
+  if (info.Length() > 0 && info[0]->IsObject()) {
+    options = info[0].As<Object>();
+
+    // Format of output buffers
+    formatObject = options->Get(New("format").ToLocalChecked());
+    if (!formatObject->IsUndefined()) {
+      if (!formatObject->IsUint32() || njtBytesPerPixel(formatObject->Uint32Value()) == 0) {
+        _throw("Invalid format");
+      }
+      format = formatObject->Uint32Value();
+    }
+
+    // Refuse to decode frames with more pixels than this
+    maxPixelsObject = options->Get(New("maxPixels").ToLocalChecked());
+    if (!maxPixelsObject->IsUndefined()) {
+      if (!maxPixelsObject->IsUint32()) {
+        _throw("Invalid maxPixels value");
+      }
+      maxPixels = maxPixelsObject->Uint32Value();
+    }
+  }
+
+  stream = new StreamDecompressor(format, maxPixels);
+  if (stream->Setup() != 0) {
+    delete stream;
+    retval = -1;
+    goto bailout;
+  }
+
+  stream->Wrap(info.This());
+  info.GetReturnValue().Set(info.This());
+  return;
+
+  bailout:
+  if (retval != 0) {
+    ThrowError(TypeError(errStr));
+    return;
+  }
+}
+
+NAN_METHOD(StreamDecompressor::JsSetTables) {
+  int retval = 0;
+  StreamDecompressor* stream = ObjectWrap::Unwrap<StreamDecompressor>(info.Holder());
+  Local<Object> srcObject;
+
+  if (info.Length() < 1) {
+    _throw("Too few arguments");
+  }
+
+  if (stream->busy) {
+    _throw("Stream is busy");
+  }
+
+  srcObject = info[0].As<Object>();
+  if (!Buffer::HasInstance(srcObject)) {
+    _throw("Invalid source buffer");
+  }
+
+  retval = stream->SetTables((unsigned char*) Buffer::Data(srcObject), Buffer::Length(srcObject));
+
+  bailout:
+  if (retval != 0) {
+    ThrowError(TypeError(errStr));
+    return;
+  }
+}
+
+void streamDecompressParse(const Nan::FunctionCallbackInfo<Value>& info, bool async) {
+  int retval = 0;
+
+  StreamDecompressor* stream = ObjectWrap::Unwrap<StreamDecompressor>(info.Holder());
+  Callback *callback = NULL;
+  Local<Object> srcObject;
+  unsigned char* srcData = NULL;
+  uint32_t srcLength = 0;
+
+  // Output
+  unsigned char* dstData = NULL;
+  int width;
+  int height;
+  uint32_t dstLength;
+
+  // Try to find callback here, so if we want to throw something we can use callback's err
+  if (async) {
+    if (info[info.Length() - 1]->IsFunction()) {
+      callback = new Callback(info[info.Length() - 1].As<Function>());
+    }
+    else {
+      _throw("Missing callback");
+    }
+  }
+
+  if ((async && info.Length() < 2) || (!async && info.Length() < 1)) {
+    _throw("Too few arguments");
+  }
+
+  // Frames share state, so only one may be in flight at a time
+  if (stream->busy) {
+    _throw("Stream is busy");
+  }
+
+  // Input buffer
+  srcObject = info[0].As<Object>();
+  if (!Buffer::HasInstance(srcObject)) {
+    _throw("Invalid source buffer");
+  }
+
+  srcData = (unsigned char*) Buffer::Data(srcObject);
+  srcLength = Buffer::Length(srcObject);
+
+  if (async) {
+    AsyncQueueWorker(new StreamDecompressWorker(callback, stream, srcObject, srcData, srcLength));
+    return;
+  }
+  else {
+    retval = stream->Decompress(srcData, srcLength, NULL, &width, &height, &dstLength, &dstData);
+    if (retval != 0) {
+      goto bailout;
+    }
+
+    Local<Object> obj = New<Object>();
+
+    obj->Set(New("data").ToLocalChecked(), njtNewBuffer(dstData, dstLength));
+    njtReleaseMemory(dstLength);
+    obj->Set(New("width").ToLocalChecked(), New(width));
+    obj->Set(New("height").ToLocalChecked(), New(height));
+    obj->Set(New("size").ToLocalChecked(), New(dstLength));
+    obj->Set(New("format").ToLocalChecked(), New(stream->format));
+
+    info.GetReturnValue().Set(obj);
+    return;
+  }
+
+  // If we have error throw error or call callback with error
+  bailout:
+  if (retval != 0) {
+    if (NULL == callback) {
+      ThrowError(TypeError(errStr));
+    }
+    else {
+      Local<Value> argv[] = {
+        New(errStr).ToLocalChecked()
+      };
+      callback->Call(1, argv);
+    }
+    return;
+  }
+}
+
+NAN_METHOD(StreamDecompressor::JsDecompressSync) {
+  streamDecompressParse(info, false);
+}
+
+NAN_METHOD(StreamDecompressor::JsDecompress) {
+  streamDecompressParse(info, true);
+}
+
+NAN_MODULE_INIT(InitStreamCompressor) {
+  StreamCompressor::Init(target);
+}
+
+NAN_MODULE_INIT(InitStreamDecompressor) {
+  StreamDecompressor::Init(target);
+}